@@ -0,0 +1,79 @@
+// Receiving end of one Crow bus, instantiable so one board can watch several
+// panels. CrowBusPort is the state shared between the clock ISR and loop():
+// the ring the ISR packs the sampled bits into, the keypress transmitter and
+// the counters. CrowBusReceiver adds the falling edge handler, templated on
+// the clock and data line types so every bus gets its own handler with its
+// pins fixed at compile time, as fast as a single hard-coded bus.
+//
+// Line types provide static read(), and for the data line also write(bool),
+// output() (drive the line) and input() (release it).
+#pragma once
+
+#include <stdint.h>
+#include "CrowPlatform.h"
+#include "CrowEdgeFilter.h"
+#include "CrowStats.h"
+#include "CrowTransmitter.h"
+#include "SpscRing.h"
+
+const uint8_t crowIdleOnesToSend = 10;  // consecutive 1 bits on the line before the bus is idle
+
+class CrowBusPort {
+ public:
+  // Bits sampled by the ISR, MSB first, 8 per byte
+  SpscRing<uint8_t, 256> rxRing;
+  // Key presses queued by loop() and shifted out on the clock edges once the
+  // bus is idle
+  CrowTransmitter transmitter;
+  CrowEdgeFilter clockFilter;
+
+  volatile bool cansend = false;      // bus idle, a keypress may start on the next clock edge
+  volatile uint32_t rxOverflows = 0;  // bytes lost because loop() did not drain the ring in time
+  volatile uint32_t busEdges = 0;     // falling clock edges accepted
+  CrowHistogram<8, 6> isrCycles;      // handler cost per edge, recorded by the ISR
+
+ protected:
+  uint8_t rxShift = 0;
+  uint8_t rxBitCount = 0;
+  uint8_t rxIdleOnes = 0;
+};
+
+template <typename ClockLine, typename DataLine>
+class CrowBusReceiver : public CrowBusPort {
+ public:
+  // Call from the clock ISR on every falling edge. now is the cycle count at
+  // the start of the ISR, in the ticks the transmitter and filter use.
+  CROW_ALWAYS_INLINE void onClockEdge(uint32_t now) {
+    if (!clockFilter.accept(now, !ClockLine::read())) {
+      return;
+    }
+    uint8_t dbit = DataLine::read();
+
+    rxShift = (rxShift << 1) | dbit;
+    if (++rxBitCount == 8) {
+      if (!rxRing.push(rxShift)) {
+        rxOverflows = rxOverflows + 1;
+      }
+      rxBitCount = 0;
+    }
+
+    if (dbit == 1) {
+      if (rxIdleOnes < crowIdleOnesToSend) {
+        rxIdleOnes++;
+      }
+    } else {
+      rxIdleOnes = 0;
+    }
+    cansend = rxIdleOnes >= crowIdleOnesToSend;
+
+    CrowTxLine line = transmitter.onClockEdge(cansend, now);
+    if (line == crowTxLow || line == crowTxHigh) {
+      DataLine::write(line == crowTxHigh);
+      DataLine::output();
+    } else if (line == crowTxRelease) {
+      DataLine::input();
+    }
+
+    busEdges = busEdges + 1;
+  }
+};
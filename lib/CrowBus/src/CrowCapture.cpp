@@ -0,0 +1,97 @@
+#include "CrowCapture.h"
+
+#include <string.h>
+
+static const uint8_t captureVersion = 1;
+static const size_t recordOverhead = 5;  // cycles and length
+
+size_t crowReadCaptureHeader(const uint8_t* data, size_t length, CrowCaptureHeader& header) {
+  if (length < sizeof(header)) {
+    return 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.magic[0] != 'C' || header.magic[1] != 'C' || header.version != captureVersion ||
+      header.length > crowCaptureBatchBytes - sizeof(header)) {
+    return 0;
+  }
+  return sizeof(header) + header.length;
+}
+
+const uint8_t* crowReadCaptureRecord(const uint8_t* p, const uint8_t* end, uint32_t& cycles, CrowFrame& frame) {
+  if (end - p < (ptrdiff_t)recordOverhead) {
+    return nullptr;
+  }
+  cycles = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+  frame.length = p[4];
+  p += recordOverhead;
+  if (frame.length > crowMaxFrameBytes || end - p < frame.length) {
+    return nullptr;
+  }
+  memcpy(frame.bytes, p, frame.length);
+  return p + frame.length;
+}
+
+void CrowCaptureBatcher::begin(uint8_t cpuMHz) {
+  memset(&header, 0, sizeof(header));
+  header.magic[0] = 'C';
+  header.magic[1] = 'C';
+  header.version = captureVersion;
+  header.cpuMHz = cpuMHz;
+  used = 0;
+  started = false;
+  framesCaptured = 0;
+  framesLost = 0;
+  batchesSent = 0;
+}
+
+bool CrowCaptureBatcher::add(const CrowFrame& frame, uint32_t cycles, uint32_t nowMs) {
+  size_t size = recordOverhead + frame.length;
+  if (sizeof(header) + used + size > crowCaptureBatchBytes) {
+    framesLost++;
+    header.lostFrames = framesLost;
+    return false;
+  }
+  if (!started) {
+    started = true;
+    header.startMs = nowMs;
+    header.startCycles = cycles;
+  }
+  uint8_t* p = buffer + sizeof(header) + used;
+  p[0] = cycles;
+  p[1] = cycles >> 8;
+  p[2] = cycles >> 16;
+  p[3] = cycles >> 24;
+  p[4] = frame.length;
+  memcpy(p + recordOverhead, frame.bytes, frame.length);
+  used += size;
+  header.count++;
+  framesCaptured++;
+  return true;
+}
+
+bool CrowCaptureBatcher::due(uint32_t nowMs) const {
+  if (!started) {
+    return false;
+  }
+  return sizeof(header) + used + recordOverhead + crowMaxFrameBytes > crowCaptureBatchBytes ||
+         nowMs - header.startMs >= flushMs;
+}
+
+const uint8_t* CrowCaptureBatcher::data() {
+  header.length = used;
+  return buffer;
+}
+
+void CrowCaptureBatcher::sent(bool ok, uint32_t rxOverflows) {
+  if (ok) {
+    batchesSent++;
+  } else {
+    framesLost += header.count;
+  }
+  header.sequence++;
+  header.count = 0;
+  header.lostFrames = framesLost;
+  header.rxOverflows = rxOverflows;
+  used = 0;
+  started = false;
+}
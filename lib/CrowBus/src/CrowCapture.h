@@ -0,0 +1,72 @@
+// Raw frame capture in binary batches.
+// Every deframed frame is appended, with the CPU cycle count at which it was
+// deframed, to a batch that is sent as one message (MQTT or TCP) when it is
+// full or flushMs old, instead of one hex publish per frame. Frames that
+// cannot be sent are counted, never waited for, so a capture can run on a
+// live system without holding up the bus decoder.
+//
+// Batch layout, little endian: CrowCaptureHeader, then count records of
+// { uint32_t cycles; uint8_t length; uint8_t bytes[length]; } with the frame
+// bytes including both flags.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "CrowDeframer.h"
+
+const size_t crowCaptureBatchBytes = 1024;
+
+struct CrowCaptureHeader {
+  uint8_t magic[2];      // "CC"
+  uint8_t version;
+  uint8_t cpuMHz;        // cycles per microsecond
+  uint16_t sequence;     // batch number, a gap means batches were lost
+  uint16_t count;        // frames in this batch
+  uint32_t startMs;      // millis() ...
+  uint32_t startCycles;  // ... and cycle count when the batch was started
+  uint32_t lostFrames;   // frames lost since the capture started
+  uint32_t rxOverflows;  // bytes lost by the clock ISR, as in the telemetry
+  uint16_t length;       // bytes of records after the header
+  uint16_t reserved;
+};
+
+// Parse the header at data. Returns the size of the whole batch, which may
+// be more than length if it has not all arrived yet, or 0 if data does not
+// start with a valid header.
+size_t crowReadCaptureHeader(const uint8_t* data, size_t length, CrowCaptureHeader& header);
+// Read the record at p (inside a batch ending at end). Returns the next
+// record, or nullptr if the record is malformed.
+const uint8_t* crowReadCaptureRecord(const uint8_t* p, const uint8_t* end, uint32_t& cycles, CrowFrame& frame);
+
+class CrowCaptureBatcher {
+ public:
+  // Start a new capture: counters and batch numbers restart from 0
+  void begin(uint8_t cpuMHz);
+
+  // Append a frame. Returns false (and counts it as lost) if the batch is
+  // full because the previous send has not happened yet.
+  bool add(const CrowFrame& frame, uint32_t cycles, uint32_t nowMs);
+
+  // A batch is due when it is full or its oldest frame is flushMs old
+  bool due(uint32_t nowMs) const;
+  // The batch to send, valid until sent() is called
+  const uint8_t* data();
+  size_t length() const { return sizeof(CrowCaptureHeader) + used; }
+  // Report what happened to the batch and start the next one. rxOverflows
+  // is copied into the next header.
+  void sent(bool ok, uint32_t rxOverflows);
+
+  uint32_t flushMs = 1000;
+
+  uint32_t framesCaptured = 0;
+  uint32_t framesLost = 0;
+  uint32_t batchesSent = 0;
+
+ private:
+  union {
+    CrowCaptureHeader header;
+    uint8_t buffer[crowCaptureBatchBytes];
+  };
+  size_t used = 0;
+  bool started = false;
+};
@@ -0,0 +1,93 @@
+#include "CrowCommand.h"
+
+void CrowCommandPipeline::start(const char* name, const uint8_t* keys, uint8_t count, uint8_t target,
+                                uint8_t ackStatuses, uint32_t nowMs) {
+  uint8_t i = 0;
+  for (; i < crowMaxCommandName && name[i] != '\0'; i++) {
+    commandName[i] = name[i];
+  }
+  commandName[i] = '\0';
+  keyCount = count > crowMaxCommandKeys ? crowMaxCommandKeys : count;
+  for (i = 0; i < keyCount; i++) {
+    keyList[i] = keys[i];
+  }
+  targetStatus = target;
+  ackMask = ackStatuses;
+  attempts = 1;
+  startedMs = nowMs;
+  phaseMs = nowMs;
+  state = stateQueue;
+}
+
+bool CrowCommandPipeline::takeKeys(const uint8_t*& keys, uint8_t& count) {
+  if (state != stateQueue) {
+    return false;
+  }
+  keys = keyList;
+  count = keyCount;
+  state = stateSending;
+  return true;
+}
+
+void CrowCommandPipeline::keysSent(uint32_t nowMs) {
+  if (state == stateSending) {
+    state = stateWaitAck;
+    phaseMs = nowMs;
+  }
+}
+
+void CrowCommandPipeline::onStatus(uint8_t status, uint32_t nowMs) {
+  if (state != stateWaitAck && state != stateWaitDone) {
+    return;
+  }
+  if (status == targetStatus) {
+    finish(crowCommandOk, nowMs);
+  } else if (ackMask & (1u << status)) {
+    if (state == stateWaitAck) {
+      state = stateWaitDone;
+      phaseMs = nowMs;
+    }
+  } else if (state == stateWaitDone) {
+    // Accepted, but then went somewhere else (e.g. arming cancelled)
+    finish(crowCommandFailed, nowMs);
+  }
+}
+
+void CrowCommandPipeline::cancel(uint32_t nowMs) {
+  if (state != stateIdle) {
+    finish(crowCommandCancelled, nowMs);
+  }
+}
+
+CrowCommandOutcome CrowCommandPipeline::poll(uint32_t nowMs) {
+  if (state == stateWaitAck && nowMs - phaseMs >= ackTimeoutMs) {
+    if (attempts <= maxRetries) {
+      attempts++;
+      retries++;
+      state = stateQueue;
+      phaseMs = nowMs;
+      pending = crowCommandRetry;
+    } else {
+      finish(crowCommandFailed, nowMs);
+    }
+  } else if (state == stateWaitDone && nowMs - phaseMs >= doneTimeoutMs) {
+    finish(crowCommandFailed, nowMs);
+  }
+  CrowCommandOutcome outcome = pending;
+  pending = crowCommandNone;
+  return outcome;
+}
+
+void CrowCommandPipeline::finish(CrowCommandOutcome outcome, uint32_t nowMs) {
+  state = stateIdle;
+  pending = outcome;
+  if (outcome == crowCommandOk) {
+    commandsOk++;
+    lastLatencyMs = nowMs - startedMs;
+    if (lastLatencyMs > maxLatencyMs) {
+      maxLatencyMs = lastLatencyMs;
+    }
+  } else if (outcome == crowCommandFailed) {
+    commandsFailed++;
+  }
+}
@@ -0,0 +1,75 @@
+// Keypress command pipeline with acknowledgement from the panel.
+// A command is a keypress sequence plus the status it should lead to. The
+// whole sequence is handed to the transmitter at once; afterwards the decoded
+// status frames are watched for the expected transition (e.g. 0 -> 5 -> 1)
+// and the sequence is resent if the panel does not react in time.
+#pragma once
+
+#include <stdint.h>
+
+const uint8_t crowMaxCommandKeys = 12;
+const uint8_t crowMaxCommandName = 12;
+
+enum CrowCommandOutcome : uint8_t {
+  crowCommandNone,       // nothing new to report
+  crowCommandOk,         // target status reached
+  crowCommandRetry,      // no reaction from the panel, sequence queued again
+  crowCommandFailed,     // retries exhausted or the panel went elsewhere
+  crowCommandCancelled,  // replaced by a newer command
+};
+
+class CrowCommandPipeline {
+ public:
+  // Start a command. ackStatuses is a bitmask (bit n = status n) of the
+  // intermediate states that show the panel accepted the keys, e.g. arming.
+  // cancel() a running command first if its result should still be reported.
+  void start(const char* name, const uint8_t* keys, uint8_t count, uint8_t target,
+             uint8_t ackStatuses, uint32_t nowMs);
+
+  // Abandon the running command; poll() then reports crowCommandCancelled
+  void cancel(uint32_t nowMs);
+
+  // Keys that have to be queued for transmission, once per attempt.
+  // Returns false when there is nothing to send.
+  bool takeKeys(const uint8_t*& keys, uint8_t& count);
+  // Tell the pipeline the transmitter has put all the keys on the bus
+  void keysSent(uint32_t nowMs);
+  bool waitingForTransmit() const { return state == stateSending; }
+
+  // Feed every decoded status frame
+  void onStatus(uint8_t status, uint32_t nowMs);
+
+  // Check timeouts and collect the outcome of the current command
+  CrowCommandOutcome poll(uint32_t nowMs);
+
+  bool active() const { return state != stateIdle; }
+  const char* name() const { return commandName; }
+  uint8_t attempt() const { return attempts; }
+  uint32_t latencyMs() const { return lastLatencyMs; }  // start to target status, last success
+
+  uint32_t ackTimeoutMs = 5000;     // after the keys are sent, for the first reaction
+  uint32_t doneTimeoutMs = 90000;   // after the reaction, for the target (exit delay)
+  uint8_t maxRetries = 2;
+
+  uint32_t commandsOk = 0;
+  uint32_t commandsFailed = 0;
+  uint32_t retries = 0;
+  uint32_t maxLatencyMs = 0;
+
+ private:
+  enum State : uint8_t { stateIdle, stateQueue, stateSending, stateWaitAck, stateWaitDone };
+
+  void finish(CrowCommandOutcome outcome, uint32_t nowMs);
+
+  State state = stateIdle;
+  CrowCommandOutcome pending = crowCommandNone;
+  char commandName[crowMaxCommandName + 1] = "";
+  uint8_t keyList[crowMaxCommandKeys];
+  uint8_t keyCount = 0;
+  uint8_t targetStatus = 0;
+  uint8_t ackMask = 0;
+  uint8_t attempts = 0;
+  uint32_t startedMs = 0;
+  uint32_t phaseMs = 0;
+  uint32_t lastLatencyMs = 0;
+};
@@ -0,0 +1,52 @@
+#include "CrowDecoder.h"
+#include "CrowStatusTable.h"
+
+// The status bits of a CrowPanelFrame are decoded through the table in
+// CrowStatusTable.h.
+static constexpr CrowStatusTable statusTable = crowBuildStatusTable();
+static_assert(crowStatusTableMatchesLegacy(statusTable),
+              "status transition table differs from the reference if/else cascade");
+
+static uint16_t zoneBits(uint8_t msbFirst, uint8_t offset) {
+  uint16_t zones = 0;
+  for (uint8_t i = 0; i < 8; i++) {
+    if (msbFirst & (0x80 >> i)) {
+      zones |= 1u << (i + offset);
+    }
+  }
+  return zones;
+}
+
+bool crowDecodeFrame(const CrowFrame& frame, uint8_t previousStatus, CrowDecoded& out) {
+  if (frame.length != crowStatusFrameLength) {
+    return false;
+  }
+  CrowPanelFrame panel(frame);
+  out.isStatus = panel.isStatus();
+  if (out.isStatus) {
+    out.status = statusTable.lookup(crowStatusInputs(panel), previousStatus);
+    out.zoneMask = 0;
+    out.activeZones = 0;
+    out.triggeredZones = 0;
+  } else {
+    uint8_t offset = panel.highZones() ? 8 : 0;
+    out.status = previousStatus;
+    out.zoneMask = 0xFFu << offset;
+    out.activeZones = zoneBits(panel.activeBits(), offset);
+    out.triggeredZones = zoneBits(panel.triggeredBits(), offset);
+  }
+  return true;
+}
+
+const char* crowStatusName(uint8_t status) {
+  static const char* const names[crowStatusCount] = {
+    "Desarmado",
+    "Armado Total",
+    "Armado Parcial",
+    "Alarme Despoletado",
+    "Chime",
+    "A armar Total",
+    "A armar Parcial",
+  };
+  return status < crowStatusCount ? names[status] : nullptr;
+}
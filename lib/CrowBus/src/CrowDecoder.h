@@ -0,0 +1,81 @@
+// Decoding of the 72-bit status/zone frames sent by the Crow Runner panel.
+// Hardware independent so it can be replayed and benchmarked on the host.
+#pragma once
+
+#include <stdint.h>
+#include "CrowDeframer.h"
+
+// 0x7E, 7 data bytes, 0x7E
+const uint8_t crowStatusFrameLength = 9;
+
+// Values kept in `status` and persisted across restarts
+enum CrowStatus : uint8_t {
+  crowDisarmed = 0,
+  crowArmedTotal = 1,
+  crowArmedPartial = 2,
+  crowTriggered = 3,
+  crowChime = 4,
+  crowArmingTotal = 5,
+  crowArmingPartial = 6,
+};
+const uint8_t crowStatusCount = 7;
+
+struct CrowDecoded {
+  bool isStatus;            // true for status frames, false for zone frames
+  uint8_t status;           // new status, only for status frames
+  uint16_t zoneMask;        // zones this frame reports on (1-8 or 9-16), bit 0 is zone 1
+  uint16_t activeZones;     // active zones, bit 0 is zone 1
+  uint16_t triggeredZones;  // zones that triggered the alarm, bit 0 is zone 1
+};
+
+// Header byte (after the opening flag) of the panel's status/zone frames
+const uint8_t crowPanelHeader = 0x02;
+
+// Read-only view of a 72-bit status/zone frame, over the frame's own bytes.
+// Data byte layout (bytes[0] is the opening flag):
+//  bytes[2] bit 7 - zone frame reports zones 9 to 16 instead of 1 to 8
+//  bytes[3]       - active zones, MSB first; on status frames the status bits
+//  bytes[4]       - triggered zones, MSB first
+//  bytes[6] bit 7 - armed total
+//  bytes[7] bit 7 - armed partial
+//  bytes[7] bit 0 - 1 on status frames, 0 on zone frames
+class CrowPanelFrame {
+ public:
+  explicit CrowPanelFrame(const CrowFrame& frame) : bytes(frame.bytes) {}
+
+  bool isStatus() const { return bytes[7] & 0x01; }
+  bool highZones() const { return bytes[2] & 0x80; }
+  uint8_t activeBits() const { return bytes[3]; }     // zone frames, MSB first
+  uint8_t triggeredBits() const { return bytes[4]; }  // zone frames, MSB first
+  uint8_t statusBits() const { return bytes[3] >> 4; }  // status frames, bits 7-4 as bits 3-0
+  bool armedTotal() const { return bytes[6] & 0x80; }
+  bool armedPartial() const { return bytes[7] & 0x80; }
+
+ private:
+  const uint8_t* bytes;
+};
+
+// Frame types, by the same layout checks as crowDecodeFrame()
+enum CrowFrameType : uint8_t {
+  crowFrameStatus,
+  crowFrameZonesLow,   // zones 1 to 8
+  crowFrameZonesHigh,  // zones 9 to 16
+  crowFrameOther,      // not 72 bits long
+};
+const uint8_t crowFrameTypeCount = 4;
+
+inline uint8_t crowFrameType(const CrowFrame& frame) {
+  if (frame.length != crowStatusFrameLength) {
+    return crowFrameOther;
+  }
+  CrowPanelFrame panel(frame);
+  return panel.isStatus() ? crowFrameStatus : panel.highZones() ? crowFrameZonesHigh : crowFrameZonesLow;
+}
+
+// Decode a status/zone frame. previousStatus is needed because the panel only
+// reports part of the state in each status frame. Returns false for frames
+// that are not 72 bits long.
+bool crowDecodeFrame(const CrowFrame& frame, uint8_t previousStatus, CrowDecoded& out);
+
+// Text published on the status topic for each status, nullptr if out of range
+const char* crowStatusName(uint8_t status);
@@ -0,0 +1,125 @@
+#include "CrowDeframer.h"
+
+static const uint8_t hdlcFlag = 0x7E;
+
+bool CrowDeframer::pushBit(uint8_t bit) {
+  if (bit) {
+    if (ones < 7) {
+      ones++;
+    }
+    if (ones == 7 && current != nullptr) {
+      // Abort sequence or idle line: throw the partial frame away
+      if (byteCount > 1) {
+        framesAborted++;
+      }
+      current = nullptr;
+    }
+  } else {
+    uint8_t run = ones;
+    ones = 0;
+    if (run == 5) {
+      // Stuffed zero inserted by the sender
+      return false;
+    }
+    if (run == 6) {
+      bool closed = false;
+      if (current != nullptr) {
+        closed = true;
+        closeFrame();
+      }
+      startFrame();
+      return closed;
+    }
+  }
+
+  if (current == nullptr) {
+    return false;
+  }
+  shift = (shift << 1) | bit;
+  if (++shiftBits == 8) {
+    if (byteCount == crowMaxFrameBytes - 1) {
+      // Leave room for the closing flag
+      framesOverlong++;
+      current = nullptr;
+      return false;
+    }
+    current->bytes[byteCount++] = shift;
+    shiftBits = 0;
+  }
+  return false;
+}
+
+void CrowDeframer::startFrame() {
+  shiftBits = 0;
+  if (readyCount == crowFramePoolSize) {
+    framesDropped++;
+    current = nullptr;
+    return;
+  }
+  current = &pool[(readyHead + readyCount) % crowFramePoolSize];
+  current->bytes[0] = hdlcFlag;
+  byteCount = 1;
+}
+
+void CrowDeframer::closeFrame() {
+  // The leading 0 and six 1s of the closing flag are already in the shift
+  // register, so a byte aligned frame leaves exactly 7 bits pending there.
+  if (shiftBits != 7) {
+    framesMisaligned++;
+    return;
+  }
+  if (byteCount == 1) {
+    // Back to back flags, nothing in between
+    return;
+  }
+  current->bytes[byteCount] = hdlcFlag;
+  current->length = byteCount + 1;
+  readyCount++;
+  framesOk++;
+}
+
+const CrowFrame* CrowDeframer::peekFrame() const {
+  if (readyCount == 0) {
+    return nullptr;
+  }
+  return &pool[readyHead];
+}
+
+void CrowDeframer::popFrame() {
+  if (readyCount == 0) {
+    return;
+  }
+  readyHead = (readyHead + 1) % crowFramePoolSize;
+  readyCount--;
+}
+
+void crowFrameToHex(const CrowFrame& frame, char* out) {
+  static const char hexDigits[] = "0123456789abcdef";
+  for (uint8_t i = 0; i < frame.length; i++) {
+    *out++ = hexDigits[frame.bytes[i] >> 4];
+    *out++ = hexDigits[frame.bytes[i] & 0x0F];
+  }
+  *out = '\0';
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool crowFrameFromHex(const char* hex, CrowFrame& out) {
+  uint8_t length = 0;
+  while (hex[0] != '\0') {
+    int high = hexValue(hex[0]);
+    int low = high < 0 ? -1 : hexValue(hex[1]);
+    if (low < 0 || length == crowMaxFrameBytes) {
+      return false;
+    }
+    out.bytes[length++] = (high << 4) | low;
+    hex += 2;
+  }
+  out.length = length;
+  return length > 0;
+}
@@ -0,0 +1,57 @@
+// HDLC-like deframer for the Crow keypad bus.
+// Raw line bits are fed in one at a time; flag (0x7E) detection and zero-bit
+// destuffing happen in a small shift register and complete frames are written,
+// byte aligned, straight into a fixed pool of frame buffers.
+#pragma once
+
+#include <stdint.h>
+
+// Largest frame we accept, including the opening and closing 0x7E flags
+const uint8_t crowMaxFrameBytes = 16;
+const uint8_t crowFramePoolSize = 4;
+
+struct CrowFrame {
+  uint8_t length;                    // number of bytes, flags included
+  uint8_t bytes[crowMaxFrameBytes];  // bytes[0] and bytes[length - 1] are always 0x7E
+
+  uint8_t bitAt(unsigned int index) const {
+    return (bytes[index >> 3] >> (7 - (index & 7))) & 1;
+  }
+};
+
+// Format the frame as lowercase hex into out, which must hold 2 * length + 1 chars
+void crowFrameToHex(const CrowFrame& frame, char* out);
+// Parse a hex dump as produced by crowFrameToHex. Returns false if it is not
+// valid hex or does not fit in a CrowFrame.
+bool crowFrameFromHex(const char* hex, CrowFrame& out);
+
+class CrowDeframer {
+ public:
+  // Feed one raw bit from the bus. Returns true when it closed a frame.
+  bool pushBit(uint8_t bit);
+
+  // Oldest completed frame, or nullptr if none are waiting
+  const CrowFrame* peekFrame() const;
+  // Return the frame from peekFrame() to the pool
+  void popFrame();
+
+  uint32_t framesOk = 0;
+  uint32_t framesMisaligned = 0;  // closing flag was not on a byte boundary
+  uint32_t framesOverlong = 0;    // more than crowMaxFrameBytes before a flag
+  uint32_t framesAborted = 0;     // 7 or more consecutive ones inside a frame
+  uint32_t framesDropped = 0;     // no free buffer in the pool
+
+ private:
+  void startFrame();
+  void closeFrame();
+
+  CrowFrame pool[crowFramePoolSize];
+  uint8_t readyHead = 0;
+  uint8_t readyCount = 0;
+  CrowFrame* current = nullptr;  // nullptr while hunting for a flag
+
+  uint8_t shift = 0;      // bits not yet completing a byte, MSB first
+  uint8_t shiftBits = 0;  // how many bits are in shift
+  uint8_t byteCount = 0;  // bytes written into current->bytes
+  uint8_t ones = 0;       // consecutive 1 bits seen on the line
+};
@@ -0,0 +1,38 @@
+// Glitch filter for the bus clock, run by the ISR on every falling edge.
+// Edges are timestamped with the cycle counter; an edge that follows the
+// previous accepted one by less than minTicks is noise and must not clock in
+// a bit. With requireLow, so is an edge whose line is already back high by
+// the time the ISR reads it; that also drops real edges whenever the ISR
+// starts later than the clock's low phase, so it is off by default.
+#pragma once
+
+#include <stdint.h>
+#include "CrowPlatform.h"
+
+class CrowEdgeFilter {
+ public:
+  // now: cycle count at the start of the ISR; lineLow: the clock still reads
+  // low. Returns true for a real clock edge.
+  CROW_ALWAYS_INLINE bool accept(uint32_t now, bool lineLow) {
+    uint32_t interval = now - lastEdge;
+    if (interval < minTicks || (requireLow && !lineLow)) {
+      glitches = glitches + 1;
+      return false;
+    }
+    lastEdge = now;
+    if (interval < minInterval) {
+      minInterval = interval;
+    }
+    return true;
+  }
+
+  // 0 disables the interval check
+  uint32_t minTicks = 0;
+  bool requireLow = false;
+
+  volatile uint32_t glitches = 0;
+  volatile uint32_t minInterval = UINT32_MAX;  // shortest accepted edge to edge time, in ticks
+
+ private:
+  uint32_t lastEdge = 0;
+};
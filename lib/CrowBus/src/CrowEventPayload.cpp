@@ -0,0 +1,30 @@
+#include "CrowEventPayload.h"
+
+size_t crowEncodeEventPayload(const CrowEventPayload& event, uint8_t* out) {
+  out[0] = crowEventPayloadVersion;
+  out[1] = event.status;
+  out[2] = event.activeZones;
+  out[3] = event.activeZones >> 8;
+  out[4] = event.triggeredZones;
+  out[5] = event.triggeredZones >> 8;
+  out[6] = event.flags;
+  out[7] = event.sequence;
+  out[8] = event.timeMs;
+  out[9] = event.timeMs >> 8;
+  out[10] = event.timeMs >> 16;
+  out[11] = event.timeMs >> 24;
+  return crowEventPayloadBytes;
+}
+
+bool crowDecodeEventPayload(const uint8_t* data, size_t length, CrowEventPayload& event) {
+  if (length < crowEventPayloadBytes || data[0] != crowEventPayloadVersion) {
+    return false;
+  }
+  event.status = data[1];
+  event.activeZones = data[2] | data[3] << 8;
+  event.triggeredZones = data[4] | data[5] << 8;
+  event.flags = data[6];
+  event.sequence = data[7];
+  event.timeMs = data[8] | data[9] << 8 | data[10] << 16 | (uint32_t)data[11] << 24;
+  return true;
+}
@@ -0,0 +1,43 @@
+// Compact binary encoding of the status and zone events, an alternative to
+// the Portuguese text payloads ("3 activo", "Armado Parcial") that can be
+// selected per topic. One fixed layout message carries the status code and
+// both zone bitmaps, so a consumer reads fields instead of matching strings
+// and a frame with several zones is one publish instead of one per zone.
+//
+// Layout, 12 bytes, little endian:
+//   0     version (crowEventPayloadVersion); later versions only append
+//         fields, so a consumer can read any message of at least 12 bytes
+//         whose version it knows
+//   1     status code, as in crowStatusName()
+//   2-3   active zones, bit n = zone n + 1
+//   4-5   triggered zones
+//   6     flags, crowEventFlag*
+//   7     sequence, incremented per message, to spot lost ones
+//   8-11  millis() on the ESP when the event was seen
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+const uint8_t crowEventPayloadVersion = 1;
+const size_t crowEventPayloadBytes = 12;
+
+enum CrowEventFlag : uint8_t {
+  crowEventFlagStatus = 1,    // the status changed (or is resynced)
+  crowEventFlagZones = 2,     // the zone bitmaps are the current active/triggered zones
+  crowEventFlagAnnounce = 4,  // the zone bitmaps are the zones being announced, as on the active_zones topic
+};
+
+struct CrowEventPayload {
+  uint8_t status;
+  uint16_t activeZones;
+  uint16_t triggeredZones;
+  uint8_t flags;
+  uint8_t sequence;
+  uint32_t timeMs;
+};
+
+// Write the message into out (crowEventPayloadBytes). Returns its length.
+size_t crowEncodeEventPayload(const CrowEventPayload& event, uint8_t* out);
+// Returns false if data is too short or of an unknown version
+bool crowDecodeEventPayload(const uint8_t* data, size_t length, CrowEventPayload& event);
@@ -0,0 +1,106 @@
+#include "CrowEvents.h"
+
+static uint8_t bitCount(uint16_t value) {
+  uint8_t count = 0;
+  for (; value != 0; value &= value - 1) {
+    count++;
+  }
+  return count;
+}
+
+void CrowEventFilter::onStatus(uint8_t status, uint32_t nowMs) {
+  unfilteredPublishes++;
+  currentStatus = status;
+  statusKnown = true;
+  if (status != publishedStatus && !statusPending) {
+    statusPending = true;
+    statusSinceMs = nowMs;
+  }
+}
+
+void CrowEventFilter::updateZones(uint16_t mask, uint16_t& current, uint16_t incoming, uint32_t* lastSeen,
+                                  uint32_t nowMs) {
+  incoming &= mask;
+  for (uint8_t zone = 0; zone < 16; zone++) {
+    if (incoming & (1u << zone)) {
+      lastSeen[zone] = nowMs;
+    }
+  }
+  current = (current & ~mask) | incoming;
+}
+
+void CrowEventFilter::expireZones(uint16_t& current, const uint32_t* lastSeen, uint32_t nowMs) {
+  for (uint8_t zone = 0; zone < 16; zone++) {
+    if ((current & (1u << zone)) && nowMs - lastSeen[zone] >= zoneHoldMs) {
+      current &= ~(1u << zone);
+    }
+  }
+}
+
+void CrowEventFilter::onZones(uint16_t mask, uint16_t newActive, uint16_t newTriggered, uint32_t nowMs) {
+  unfilteredPublishes += bitCount(newActive & mask) + bitCount(newTriggered & mask);
+  uint16_t oldActive = active;
+  uint16_t oldTriggered = triggered;
+  updateZones(mask, active, newActive, activeSeenMs, nowMs);
+  updateZones(mask, triggered, newTriggered, triggeredSeenMs, nowMs);
+  risingActive |= active & ~oldActive;
+  risingTriggered |= triggered & ~oldTriggered;
+  if ((active != oldActive || triggered != oldTriggered) && !zonesPending) {
+    zonesPending = true;
+    zonesSinceMs = nowMs;
+  }
+}
+
+bool CrowEventFilter::poll(uint32_t nowMs, CrowPublishPlan& plan) {
+  plan.status = false;
+  plan.zones = false;
+  plan.announceActive = 0;
+  plan.announceTriggered = 0;
+
+  uint16_t oldActive = active;
+  uint16_t oldTriggered = triggered;
+  expireZones(active, activeSeenMs, nowMs);
+  expireZones(triggered, triggeredSeenMs, nowMs);
+  if ((active != oldActive || triggered != oldTriggered) && !zonesPending) {
+    zonesPending = true;
+    zonesSinceMs = nowMs;
+  }
+
+  bool snapshot = snapshotMs != 0 && nowMs - lastSnapshotMs >= snapshotMs;
+  if (snapshot) {
+    lastSnapshotMs = nowMs;
+  }
+
+  if (statusKnown && ((statusPending && nowMs - statusSinceMs >= coalesceMs) || snapshot)) {
+    statusPending = false;
+    if (currentStatus != publishedStatus || snapshot) {
+      plan.status = true;
+      plan.statusValue = currentStatus;
+      publishedStatus = currentStatus;
+    }
+  }
+
+  if ((zonesPending && nowMs - zonesSinceMs >= coalesceMs) || snapshot) {
+    zonesPending = false;
+    if (active != publishedActive || triggered != publishedTriggered || snapshot) {
+      plan.zones = true;
+      publishedActive = active;
+      publishedTriggered = triggered;
+    }
+    // Newly active zones are announced together with the bitmap change
+    plan.announceActive = risingActive & active;
+    plan.announceTriggered = risingTriggered & triggered;
+    risingActive = 0;
+    risingTriggered = 0;
+  }
+
+  if (zoneRefreshMs != 0 && nowMs - lastRefreshMs >= zoneRefreshMs) {
+    lastRefreshMs = nowMs;
+    plan.announceActive |= active;
+    plan.announceTriggered |= triggered;
+  }
+
+  plan.activeZones = publishedActive;
+  plan.triggeredZones = publishedTriggered;
+  return plan.status || plan.zones || plan.announceActive || plan.announceTriggered;
+}
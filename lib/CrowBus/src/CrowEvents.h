@@ -0,0 +1,59 @@
+// Change detection and coalescing between the decoder and MQTT.
+// The panel repeats the same status and zone frames continuously; this keeps
+// the last published state and only lets real changes through, grouping a
+// burst of changes within coalesceMs into a single publish.
+#pragma once
+
+#include <stdint.h>
+
+// What should be published after a call to CrowEventFilter::poll()
+struct CrowPublishPlan {
+  bool status;              // publish statusValue (retained)
+  uint8_t statusValue;
+  bool zones;               // publish the active/triggered bitmaps (retained)
+  uint16_t activeZones;     // bit 0 is zone 1
+  uint16_t triggeredZones;
+  uint16_t announceActive;     // zones to announce with a "<n> activo" message
+  uint16_t announceTriggered;  // zones to announce with a "<n> triggered" message
+};
+
+class CrowEventFilter {
+ public:
+  void onStatus(uint8_t status, uint32_t nowMs);
+  // mask: zones the frame reports on; active/triggered: their state
+  void onZones(uint16_t mask, uint16_t active, uint16_t triggered, uint32_t nowMs);
+
+  // Returns true if plan has anything to publish
+  bool poll(uint32_t nowMs, CrowPublishPlan& plan);
+
+  uint16_t coalesceMs = 200;     // changes within this window go out together
+  uint16_t zoneHoldMs = 3000;    // a zone not reported for this long is inactive
+  uint16_t zoneRefreshMs = 3000; // re-announce active zones (keeps HA off_delay sensors on), 0 = never
+  uint32_t snapshotMs = 60000;   // full state resync, 0 = never
+
+  uint32_t unfilteredPublishes = 0;  // what publishing every frame would have cost
+
+ private:
+  void updateZones(uint16_t mask, uint16_t& current, uint16_t incoming, uint32_t* lastSeen, uint32_t nowMs);
+  void expireZones(uint16_t& current, const uint32_t* lastSeen, uint32_t nowMs);
+
+  uint8_t currentStatus = 0;
+  bool statusKnown = false;
+  uint8_t publishedStatus = 0xFF;
+  bool statusPending = false;
+  uint32_t statusSinceMs = 0;
+
+  uint16_t active = 0;
+  uint16_t triggered = 0;
+  uint16_t publishedActive = 0;
+  uint16_t publishedTriggered = 0;
+  uint16_t risingActive = 0;
+  uint16_t risingTriggered = 0;
+  bool zonesPending = false;
+  uint32_t zonesSinceMs = 0;
+  uint32_t activeSeenMs[16] = {};
+  uint32_t triggeredSeenMs[16] = {};
+
+  uint32_t lastRefreshMs = 0;
+  uint32_t lastSnapshotMs = 0;
+};
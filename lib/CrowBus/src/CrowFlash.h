@@ -0,0 +1,18 @@
+// Minimal flash access used by the CrowBus storage classes, so they can run
+// against the ESP8266 SPI flash on the device and a RAM image on the host.
+#pragma once
+
+#include <stdint.h>
+
+const uint32_t crowFlashSectorSize = 4096;
+
+// A run of whole flash sectors. Offsets are relative to the start of the
+// region; reads and writes are 4-byte aligned and erased flash reads as 0xFF.
+class CrowFlashRegion {
+ public:
+  virtual ~CrowFlashRegion() {}
+  virtual uint16_t sectorCount() const = 0;
+  virtual bool read(uint32_t offset, uint32_t* data, uint32_t length) = 0;
+  virtual bool write(uint32_t offset, const uint32_t* data, uint32_t length) = 0;
+  virtual bool eraseSector(uint16_t sector) = 0;
+};
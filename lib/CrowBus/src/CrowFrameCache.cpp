@@ -0,0 +1,34 @@
+#include "CrowFrameCache.h"
+
+#include <string.h>
+
+bool CrowFrameCache::lookup(const CrowFrame& frame, uint8_t previousStatus, CrowDecoded& decoded) {
+  uint8_t type = crowFrameType(frame);
+  if (type == crowFrameOther) {
+    misses++;
+    return false;
+  }
+  const Entry& entry = entries[type];
+  if (!entry.valid || memcmp(entry.bytes, frame.bytes, crowStatusFrameLength) != 0 ||
+      (type == crowFrameStatus &&
+       (entry.previousStatus != previousStatus || entry.decoded.status != previousStatus))) {
+    misses++;
+    return false;
+  }
+  hits++;
+  decoded = entry.decoded;
+  decoded.status = previousStatus;
+  return true;
+}
+
+void CrowFrameCache::store(const CrowFrame& frame, uint8_t previousStatus, const CrowDecoded& decoded) {
+  uint8_t type = crowFrameType(frame);
+  if (type == crowFrameOther) {
+    return;
+  }
+  Entry& entry = entries[type];
+  entry.valid = true;
+  entry.previousStatus = previousStatus;
+  memcpy(entry.bytes, frame.bytes, crowStatusFrameLength);
+  entry.decoded = decoded;
+}
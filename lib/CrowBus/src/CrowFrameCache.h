@@ -0,0 +1,32 @@
+// Memo of the last decoded frame of each type. The panel repeats the same
+// status and zone frames over and over; a frame identical to the last one of
+// its type gets that frame's decoded result back, so the caller can skip the
+// decode and everything that only matters when something changed.
+#pragma once
+
+#include <stdint.h>
+#include "CrowDecoder.h"
+
+class CrowFrameCache {
+ public:
+  // True if frame repeats the last stored frame of its type and changes
+  // nothing: decoded is then its result. A status frame only hits when it was
+  // stored with the same previous status and decoded to that same status, as
+  // status decoding depends on the previous status.
+  bool lookup(const CrowFrame& frame, uint8_t previousStatus, CrowDecoded& decoded);
+  // Remember a frame that missed and what it decoded to
+  void store(const CrowFrame& frame, uint8_t previousStatus, const CrowDecoded& decoded);
+
+  uint32_t hits = 0;
+  uint32_t misses = 0;
+
+ private:
+  struct Entry {
+    bool valid;
+    uint8_t previousStatus;
+    uint8_t bytes[crowStatusFrameLength];
+    CrowDecoded decoded;
+  };
+  // Status, zones 1-8 and zones 9-16; other frames are never cached
+  Entry entries[crowFrameOther] = {};
+};
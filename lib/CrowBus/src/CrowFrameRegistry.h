@@ -0,0 +1,66 @@
+// Dispatch of deframed frames to a handler per frame type. The type is the
+// header byte after the opening flag, the address of whoever sent the frame
+// (crowPanelHeader for the panel's status/zone frames, crowKeypadHeader for
+// keypress packets), and each type has a fixed length. A 256 entry table
+// indexed by the header byte finds the handler in one lookup, however many
+// types are registered, so a new one (keypad LEDs, beeps, troubles) is a
+// handler and an add() call.
+//
+// Frames of a registered length but an unregistered header can go to a
+// fallback handler: the firmware decoded every 72-bit frame before types
+// were told apart, and still does.
+#pragma once
+
+#include <stdint.h>
+#include "CrowDeframer.h"
+
+template <typename Context>
+class CrowFrameRegistry {
+ public:
+  typedef void (*Handler)(Context& context, const CrowFrame& frame);
+
+  // Returns false if the header is taken or the table is full
+  bool add(uint8_t header, uint8_t length, Handler handler) {
+    if (slots[header] != 0 || count == maxTypes) {
+      return false;
+    }
+    types[count] = {length, handler};
+    slots[header] = ++count;
+    return true;
+  }
+
+  // Handler for frames of this length whose header is not registered
+  void setFallback(uint8_t length, Handler handler) {
+    fallbackLength = length;
+    fallback = handler;
+  }
+
+  // Run the handler of the frame's type. Returns false if the type is not
+  // registered, whether or not the fallback took the frame.
+  bool dispatch(Context& context, const CrowFrame& frame) const {
+    if (frame.length > 2) {
+      uint8_t slot = slots[frame.bytes[1]];
+      if (slot != 0 && types[slot - 1].length == frame.length) {
+        types[slot - 1].handler(context, frame);
+        return true;
+      }
+    }
+    if (fallback != nullptr && frame.length == fallbackLength) {
+      fallback(context, frame);
+    }
+    return false;
+  }
+
+ private:
+  static const uint8_t maxTypes = 8;
+
+  struct Type {
+    uint8_t length;
+    Handler handler;
+  };
+  uint8_t slots[256] = {};  // by header byte, 1 + index into types, 0 if none
+  Type types[maxTypes] = {};
+  uint8_t count = 0;
+  uint8_t fallbackLength = 0;
+  Handler fallback = nullptr;
+};
@@ -0,0 +1,179 @@
+#include "CrowJournal.h"
+
+static const uint8_t recordMarker = 0xA5;
+
+static uint8_t crc8(const uint8_t* data, uint8_t length) {
+  uint8_t crc = 0;
+  while (length--) {
+    crc ^= *data++;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static uint8_t recordCrc(const CrowJournalRecord& record) {
+  return crc8((const uint8_t*)&record, sizeof(record) - 1);
+}
+
+uint8_t crowStableStatus(uint8_t status) {
+  switch (status) {
+    case 5:  // arming total
+      return 1;
+    case 6:  // arming partial
+      return 2;
+    default:
+      return status;
+  }
+}
+
+bool CrowStatusJournal::readSlot(uint16_t sector, uint32_t slot, CrowJournalRecord& record) {
+  recoveryReads++;
+  return flash.read(sector * crowFlashSectorSize + slot * sizeof(record), (uint32_t*)&record, sizeof(record));
+}
+
+bool CrowStatusJournal::slotUsed(uint16_t sector, uint32_t slot) {
+  CrowJournalRecord record;
+  if (!readSlot(sector, slot, record)) {
+    return true;
+  }
+  const uint32_t* words = (const uint32_t*)&record;
+  return words[0] != 0xFFFFFFFF || words[1] != 0xFFFFFFFF;
+}
+
+// Slots are filled in order, so the used ones are a prefix of the sector
+int32_t CrowStatusJournal::lastUsedSlot(uint16_t sector) {
+  int32_t low = 0;
+  int32_t high = crowJournalSlotsPerSector;
+  while (low < high) {
+    int32_t mid = (low + high) / 2;
+    if (slotUsed(sector, mid)) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low - 1;
+}
+
+bool CrowStatusJournal::sectorBlank(uint16_t sector) {
+  uint32_t words[16];
+  for (uint32_t offset = 0; offset < crowFlashSectorSize; offset += sizeof(words)) {
+    if (!flash.read(sector * crowFlashSectorSize + offset, words, sizeof(words))) {
+      return false;
+    }
+    for (uint32_t word : words) {
+      if (word != 0xFFFFFFFF) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Erase the sectors that are not blank yet
+bool CrowStatusJournal::clearSectors() {
+  for (uint16_t sector = 0; sector < flash.sectorCount(); sector++) {
+    if (sectorBlank(sector)) {
+      continue;
+    }
+    erases++;
+    if (!flash.eraseSector(sector)) {
+      writeErrors++;
+      return false;
+    }
+  }
+  clearPending = false;
+  return true;
+}
+
+bool CrowStatusJournal::begin(uint8_t& status) {
+  ready = flash.sectorCount() >= 2;
+  if (!ready) {
+    return false;
+  }
+  bool found = false;
+  uint32_t bestSequence = 0;
+  for (uint16_t sector = 0; sector < flash.sectorCount(); sector++) {
+    int32_t last = lastUsedSlot(sector);
+    // Walk back over records cut off by a power loss
+    for (int32_t slot = last; slot >= 0; slot--) {
+      CrowJournalRecord record;
+      if (!readSlot(sector, slot, record) || record.marker != recordMarker || record.crc != recordCrc(record) ||
+          record.sequence == 0xFFFFFFFF) {
+        corruptRecords++;
+        continue;
+      }
+      if (!found || record.sequence > bestSequence) {
+        found = true;
+        bestSequence = record.sequence;
+        savedStatus = record.status;
+        headSector = sector;
+        nextSlot = last + 1;
+      }
+      break;
+    }
+  }
+  if (!found) {
+    // First use: whatever the region held before must not be mistaken for
+    // records later. The sectors are cleared before the first record, not
+    // here, so a board whose status never changes doesn't erase them on
+    // every boot.
+    headSector = 0;
+    nextSlot = 0;
+    clearPending = true;
+    return false;
+  }
+  nextSequence = bestSequence + 1;
+  status = savedStatus;
+  return true;
+}
+
+void CrowStatusJournal::record(uint8_t status, uint32_t nowMs) {
+  status = crowStableStatus(status);
+  if (status == wantedStatus && dirty) {
+    return;
+  }
+  wantedStatus = status;
+  dirty = status != savedStatus;
+  changedMs = nowMs;
+}
+
+bool CrowStatusJournal::service(uint32_t nowMs) {
+  if (!dirty || !ready || nowMs - changedMs < deferMs) {
+    return false;
+  }
+  if (clearPending && !clearSectors()) {
+    return false;
+  }
+  if (nextSlot >= crowJournalSlotsPerSector) {
+    // Wrap into the oldest sector
+    headSector = (headSector + 1) % flash.sectorCount();
+    nextSlot = 0;
+    erases++;
+    if (!flash.eraseSector(headSector)) {
+      writeErrors++;
+      return false;
+    }
+  }
+  CrowJournalRecord record;
+  record.sequence = nextSequence;
+  record.status = wantedStatus;
+  record.reserved = 0xFF;
+  record.marker = recordMarker;
+  record.crc = recordCrc(record);
+  bool ok = flash.write(headSector * crowFlashSectorSize + nextSlot * sizeof(record), (const uint32_t*)&record,
+                        sizeof(record));
+  // Never write the same slot twice, even after a failed write
+  nextSlot++;
+  nextSequence++;
+  if (!ok) {
+    writeErrors++;
+    return false;
+  }
+  writes++;
+  savedStatus = wantedStatus;
+  dirty = false;
+  return true;
+}
@@ -0,0 +1,66 @@
+// Append-only, wear-levelled journal of the alarm status.
+// Records carry a sequence number and a CRC and are appended across a ring
+// of flash sectors; a sector is only erased when the journal wraps into it,
+// so the newest record elsewhere survives a power loss at any point. Writes
+// are deferred and coalesced so status bursts cost a single record.
+#pragma once
+
+#include <stdint.h>
+#include "CrowFlash.h"
+
+struct CrowJournalRecord {
+  uint32_t sequence;
+  uint8_t status;
+  uint8_t reserved;
+  uint8_t marker;
+  uint8_t crc;
+};
+
+const uint32_t crowJournalSlotsPerSector = crowFlashSectorSize / sizeof(CrowJournalRecord);
+
+// Transient states are persisted as the state they lead to, so a restart
+// during the exit delay comes back armed
+uint8_t crowStableStatus(uint8_t status);
+
+class CrowStatusJournal {
+ public:
+  explicit CrowStatusJournal(CrowFlashRegion& flash) : flash(flash) {}
+
+  // Find the newest valid record. Returns false if the journal is empty.
+  bool begin(uint8_t& status);
+
+  // Remember a status change; written by service() once it has been stable
+  // for deferMs
+  void record(uint8_t status, uint32_t nowMs);
+  // Call from loop(). Returns true if a record was written.
+  bool service(uint32_t nowMs);
+  bool pending() const { return dirty; }
+  // False until begin() found a flash region of at least two sectors
+  bool active() const { return ready; }
+
+  uint32_t deferMs = 2000;
+
+  uint32_t writes = 0;
+  uint32_t erases = 0;
+  uint32_t writeErrors = 0;
+  uint32_t corruptRecords = 0;  // seen during begin(), e.g. cut off by a power loss
+  uint32_t recoveryReads = 0;   // flash reads begin() needed
+
+ private:
+  bool readSlot(uint16_t sector, uint32_t slot, CrowJournalRecord& record);
+  bool slotUsed(uint16_t sector, uint32_t slot);
+  int32_t lastUsedSlot(uint16_t sector);
+  bool sectorBlank(uint16_t sector);
+  bool clearSectors();
+
+  CrowFlashRegion& flash;
+  bool ready = false;
+  uint16_t headSector = 0;
+  uint32_t nextSlot = 0;
+  uint32_t nextSequence = 1;
+  uint8_t savedStatus = 0xFF;
+  uint8_t wantedStatus = 0xFF;
+  bool dirty = false;
+  bool clearPending = false;  // no valid record found, clear the region before the first one
+  uint32_t changedMs = 0;
+};
@@ -0,0 +1,27 @@
+#include "CrowKeypad.h"
+
+// The key code goes on the wire LSB first
+static uint8_t reverseBits(uint8_t key) {
+  uint8_t reversed = 0;
+  for (int i = 0; i < 8; i++) {
+    reversed |= ((key & 1) ? 1 : 0) << (7 - i);
+    key >>= 1;
+  }
+  return reversed;
+}
+
+void crowEncodeKeypress(uint8_t key, uint8_t* out) {
+  // Add leading bytes
+  out[0] = 0b01111110;
+  out[1] = crowKeypadHeader;
+  out[2] = 0b00000000;
+
+  out[3] = reverseBits(key);
+
+  // Add trailing byte
+  out[4] = 0b01111110;
+}
+
+uint8_t CrowKeypressFrame::key() const {
+  return reverseBits(bytes[3]);
+}
@@ -0,0 +1,31 @@
+// Encoding of keypad button presses sent to the panel.
+#pragma once
+
+#include <stdint.h>
+#include "CrowDeframer.h"
+
+// Key codes understood by the panel
+const uint8_t crowKeyEnter = 17;
+const uint8_t crowKeyTotal = 13;
+const uint8_t crowKeyParcial = 14;
+const uint8_t crowKeyPanic = 32;
+
+// Flag, keypad address, 0, key, flag
+const uint8_t crowKeypressPacketLength = 5;
+// Keypad address, the header byte of keypress packets
+const uint8_t crowKeypadHeader = 0x85;
+
+// Write the packet for one key press into out (crowKeypressPacketLength bytes)
+void crowEncodeKeypress(uint8_t key, uint8_t* out);
+
+// Read-only view of a keypress packet seen on the bus, ours or a keypad's
+class CrowKeypressFrame {
+ public:
+  explicit CrowKeypressFrame(const CrowFrame& frame) : bytes(frame.bytes) {}
+
+  uint8_t address() const { return bytes[1]; }
+  uint8_t key() const;
+
+ private:
+  const uint8_t* bytes;
+};
@@ -0,0 +1,58 @@
+// Keyword lookup over raw, non NUL-terminated payloads.
+// Tables are plain arrays of structs with a `keyword` member, sorted in
+// strcmp() order; crowKeywordsSorted() lets the owner static_assert that.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+constexpr int crowKeywordCompare(const char* keyword, const char* text, size_t length) {
+  size_t i = 0;
+  for (; i < length; i++) {
+    if (keyword[i] == '\0') {
+      return -1;  // keyword is a prefix of text, so it sorts first
+    }
+    if (keyword[i] != text[i]) {
+      return (uint8_t)keyword[i] < (uint8_t)text[i] ? -1 : 1;
+    }
+  }
+  return keyword[i] == '\0' ? 0 : 1;
+}
+
+constexpr size_t crowKeywordLength(const char* keyword) {
+  size_t length = 0;
+  while (keyword[length] != '\0') {
+    length++;
+  }
+  return length;
+}
+
+template <typename Entry, size_t N>
+constexpr bool crowKeywordsSorted(const Entry (&table)[N]) {
+  for (size_t i = 1; i < N; i++) {
+    if (crowKeywordCompare(table[i - 1].keyword, table[i].keyword, crowKeywordLength(table[i].keyword)) >= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Binary search for the entry whose keyword is exactly text[0..length)
+template <typename Entry, size_t N>
+const Entry* crowFindKeyword(const Entry (&table)[N], const char* text, size_t length) {
+  size_t low = 0;
+  size_t high = N;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    int order = crowKeywordCompare(table[mid].keyword, text, length);
+    if (order == 0) {
+      return &table[mid];
+    }
+    if (order < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return nullptr;
+}
@@ -0,0 +1,77 @@
+#include "CrowOutbox.h"
+
+#include <string.h>
+
+bool CrowOutbox::push(const char* topic, const char* payload, bool retained, uint8_t priority, uint32_t nowMs) {
+  return store(topic, payload, strlen(payload), false, retained, priority, nowMs);
+}
+
+bool CrowOutbox::pushBinary(const char* topic, const uint8_t* payload, size_t length, bool retained,
+                            uint8_t priority, uint32_t nowMs) {
+  return store(topic, payload, length, true, retained, priority, nowMs);
+}
+
+bool CrowOutbox::store(const char* topic, const void* payload, size_t length, bool binary, bool retained,
+                       uint8_t priority, uint32_t nowMs) {
+  if (length > crowOutboxPayloadBytes) {
+    dropped++;
+    return false;
+  }
+  CrowOutboxMessage* slot = nullptr;
+  if (count < crowOutboxSize) {
+    for (CrowOutboxMessage& message : messages) {
+      if (!message.used) {
+        slot = &message;
+        break;
+      }
+    }
+  } else {
+    // Full: evict the oldest of the least important messages, unless they
+    // are all more important than this one
+    for (CrowOutboxMessage& message : messages) {
+      if (slot == nullptr || message.priority < slot->priority ||
+          (message.priority == slot->priority && message.sequence < slot->sequence)) {
+        slot = &message;
+      }
+    }
+    dropped++;
+    if (slot->priority > priority) {
+      return false;
+    }
+    count--;
+  }
+  slot->topic = topic;
+  slot->queuedMs = nowMs;
+  slot->sequence = nextSequence++;
+  slot->priority = priority;
+  slot->retained = retained;
+  slot->used = true;
+  slot->binary = binary;
+  slot->length = length;
+  memcpy(slot->payload, payload, length);
+  slot->payload[length] = '\0';
+  count++;
+  if (count > maxSize) {
+    maxSize = count;
+  }
+  return true;
+}
+
+const CrowOutboxMessage* CrowOutbox::front() const {
+  const CrowOutboxMessage* next = nullptr;
+  for (const CrowOutboxMessage& message : messages) {
+    if (message.used && (next == nullptr || message.priority > next->priority ||
+                         (message.priority == next->priority && message.sequence < next->sequence))) {
+      next = &message;
+    }
+  }
+  return next;
+}
+
+void CrowOutbox::pop() {
+  CrowOutboxMessage* next = const_cast<CrowOutboxMessage*>(front());
+  if (next != nullptr) {
+    next->used = false;
+    count--;
+  }
+}
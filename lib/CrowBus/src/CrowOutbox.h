@@ -0,0 +1,75 @@
+// Bounded outbound message queue with priorities, for riding out broker and
+// Wi-Fi outages. Every small publish goes through it: it is sent right away
+// while connected and kept, with the time it was queued, while not. When the
+// queue is full the oldest message of the lowest priority makes room, so
+// status changes and alarms are the last to go, and every message lost that
+// way is counted.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum CrowPriority : uint8_t {
+  crowPriorityLow,     // debug and informational
+  crowPriorityNormal,  // log messages, zone announces, relay results
+  crowPriorityHigh,    // status, triggered zones, command results
+};
+
+const uint8_t crowOutboxSize = 24;
+const uint8_t crowOutboxPayloadBytes = 127;
+
+struct CrowOutboxMessage {
+  const char* topic;  // not copied, topics live as long as the program
+  uint32_t queuedMs;
+  uint32_t sequence;
+  uint8_t priority;
+  bool retained;
+  bool used;
+  bool binary;     // payload is not text, see CrowEventPayload.h
+  uint8_t length;  // of the payload, without the NUL text payloads end with
+  char payload[crowOutboxPayloadBytes + 1];
+};
+
+class CrowOutbox {
+ public:
+  // Returns false if the message was dropped: too long, or the queue is full
+  // of messages at least as important
+  bool push(const char* topic, const char* payload, bool retained, uint8_t priority, uint32_t nowMs);
+  bool pushBinary(const char* topic, const uint8_t* payload, size_t length, bool retained, uint8_t priority,
+                  uint32_t nowMs);
+  // Next message to send: highest priority first, in order within a priority
+  const CrowOutboxMessage* front() const;
+  void pop();
+  uint8_t size() const { return count; }
+
+  uint32_t dropped = 0;  // messages lost, by eviction or refused
+  uint8_t maxSize = 0;
+
+ private:
+  bool store(const char* topic, const void* payload, size_t length, bool binary, bool retained, uint8_t priority,
+             uint32_t nowMs);
+
+  CrowOutboxMessage messages[crowOutboxSize] = {};
+  uint8_t count = 0;
+  uint32_t nextSequence = 0;
+};
+
+// Exponential backoff between reconnection attempts
+class CrowBackoff {
+ public:
+  CrowBackoff(uint32_t firstMs, uint32_t maxMs) : firstMs(firstMs), maxMs(maxMs), delayMs(0) {}
+
+  bool due(uint32_t nowMs) const { return nowMs - lastMs >= delayMs; }
+  void failed(uint32_t nowMs) {
+    lastMs = nowMs;
+    delayMs = delayMs == 0 ? firstMs : (delayMs >= maxMs / 2 ? maxMs : delayMs * 2);
+  }
+  void reset() { delayMs = 0; }
+  uint32_t delay() const { return delayMs; }
+
+ private:
+  uint32_t firstMs;
+  uint32_t maxMs;
+  uint32_t delayMs;
+  uint32_t lastMs = 0;
+};
@@ -0,0 +1,6 @@
+// Small portability helpers shared by the CrowBus headers.
+#pragma once
+
+// Functions called from the clock ISR are forced inline so they end up in the
+// IRAM resident interrupt handler instead of flash.
+#define CROW_ALWAYS_INLINE inline __attribute__((always_inline))
@@ -0,0 +1,87 @@
+#include "CrowPulse.h"
+
+#include <stdlib.h>
+
+bool crowParsePulseOptions(const char* options, CrowPulsePattern& pattern) {
+  pattern = crowDefaultPulse;
+  if (*options == '\0') {
+    return true;
+  }
+  char* end;
+  unsigned long width = strtoul(options, &end, 10);
+  if (width == 0 || width > 10000) {
+    return false;
+  }
+  pattern.widthMs = width;
+  pattern.gapMs = width;
+  if (*end == 'x') {
+    unsigned long count = strtoul(end + 1, &end, 10);
+    if (count == 0 || count > 10) {
+      return false;
+    }
+    pattern.count = count;
+  }
+  return *end == '\0';
+}
+
+bool CrowPulseScheduler::queue(uint8_t channel, const CrowPulsePattern& pattern) {
+  if (channel >= crowPulseChannels || pattern.count == 0) {
+    return false;
+  }
+  Channel& ch = channels[channel];
+  if (ch.count == crowPulseQueueDepth) {
+    patternsDropped++;
+    return false;
+  }
+  ch.patterns[(ch.head + ch.count) % crowPulseQueueDepth] = pattern;
+  ch.count++;
+  return true;
+}
+
+void CrowPulseScheduler::update(uint32_t nowMs) {
+  changed = 0;
+  for (uint8_t i = 0; i < crowPulseChannels; i++) {
+    Channel& ch = channels[i];
+    if (ch.count == 0) {
+      continue;
+    }
+    const CrowPulsePattern& pattern = ch.patterns[ch.head];
+    uint32_t elapsed = nowMs - ch.phaseStartMs;
+    if (ch.pulsesLeft == 0) {
+      // Start the next pattern once the previous one has had its gap
+      if (elapsed < ch.restMs) {
+        continue;
+      }
+      ch.pulsesLeft = pattern.count;
+      ch.on = true;
+      ch.phaseStartMs = nowMs;
+      changed |= 1 << i;
+      continue;
+    }
+    if (ch.on) {
+      if (elapsed < pattern.widthMs) {
+        continue;
+      }
+      ch.on = false;
+      ch.phaseStartMs = nowMs;
+      changed |= 1 << i;
+      pulsesDone++;
+      if (--ch.pulsesLeft == 0) {
+        completed |= 1 << i;
+        ch.restMs = pattern.gapMs;
+        ch.head = (ch.head + 1) % crowPulseQueueDepth;
+        ch.count--;
+      }
+    } else if (elapsed >= pattern.gapMs) {
+      ch.on = true;
+      ch.phaseStartMs = nowMs;
+      changed |= 1 << i;
+    }
+  }
+}
+
+uint8_t CrowPulseScheduler::takeCompleted() {
+  uint8_t mask = completed;
+  completed = 0;
+  return mask;
+}
@@ -0,0 +1,57 @@
+// Non-blocking pulse scheduler for the keyswitch relays.
+// Each output channel has a small queue of pulse patterns; update() is called
+// from loop() and works out the level every channel should have right now, so
+// pulses on different channels overlap and nothing ever waits.
+#pragma once
+
+#include <stdint.h>
+
+const uint8_t crowPulseChannels = 4;
+const uint8_t crowPulseQueueDepth = 4;
+
+struct CrowPulsePattern {
+  uint16_t widthMs;  // time the output is on for each pulse
+  uint16_t gapMs;    // time off between pulses
+  uint8_t count;     // number of pulses, 2 for a double pulse
+};
+
+// 1 second, like the keyswitch simulation always did
+const CrowPulsePattern crowDefaultPulse = {1000, 1000, 1};
+
+// Pulse options after a relay command: "" for the default pulse, "<width ms>"
+// or "<width ms>x<count>" (e.g. "300x2" for a double pulse). Returns false if
+// options is not valid.
+bool crowParsePulseOptions(const char* options, CrowPulsePattern& pattern);
+
+class CrowPulseScheduler {
+ public:
+  // Queue a pattern on a channel. Returns false if the channel queue is full.
+  bool queue(uint8_t channel, const CrowPulsePattern& pattern);
+
+  // Advance all channels. Call often; timing resolution is the loop period.
+  void update(uint32_t nowMs);
+
+  bool level(uint8_t channel) const { return channels[channel].on; }
+  // Channels whose level changed in the last update(), bit n = channel n
+  uint8_t changedMask() const { return changed; }
+  // Channels that finished a pattern since the last call, bit n = channel n
+  uint8_t takeCompleted();
+
+  uint32_t pulsesDone = 0;
+  uint32_t patternsDropped = 0;
+
+ private:
+  struct Channel {
+    CrowPulsePattern patterns[crowPulseQueueDepth];
+    uint8_t head;
+    uint8_t count;          // patterns queued, including the running one
+    uint8_t pulsesLeft;     // of the running pattern, 0 if none is running
+    bool on;
+    uint16_t restMs;        // gap of the last finished pattern, before the next starts
+    uint32_t phaseStartMs;
+  };
+
+  Channel channels[crowPulseChannels] = {};
+  uint8_t changed = 0;
+  uint8_t completed = 0;
+};
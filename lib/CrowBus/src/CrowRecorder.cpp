@@ -0,0 +1,221 @@
+#include "CrowRecorder.h"
+
+#include <string.h>
+#include "CrowCommand.h"
+#include "CrowDecoder.h"
+
+static const uint8_t chunkVersion = 1;
+
+// Header of a flash snapshot; the records follow, oldest first
+struct SnapshotHeader {
+  uint32_t magic;
+  uint32_t sequence;
+  uint16_t count;
+  uint16_t version;
+  uint32_t checksum;
+};
+static_assert(sizeof(SnapshotHeader) % 4 == 0, "snapshot records must stay word aligned");
+static const uint32_t snapshotMagic = 0x4E534352;  // "RCSN"
+static const uint16_t snapshotSectors = 2;
+
+static uint32_t fnv1a(uint32_t hash, const uint8_t* data, size_t length) {
+  while (length--) {
+    hash = (hash ^ *data++) * 16777619u;
+  }
+  return hash;
+}
+
+static const uint32_t fnvBasis = 2166136261u;
+
+size_t crowReadRecorderChunk(const uint8_t* data, size_t length, CrowRecorderChunkHeader& header,
+                             const CrowRecord*& records) {
+  if (length < sizeof(header)) {
+    return 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.magic[0] != 'C' || header.magic[1] != 'R' || header.version != chunkVersion ||
+      header.count > crowRecorderChunkRecords || header.index >= header.chunks) {
+    return 0;
+  }
+  size_t size = sizeof(header) + header.count * sizeof(CrowRecord);
+  if (length < size) {
+    return 0;
+  }
+  records = (const CrowRecord*)(data + sizeof(header));
+  return size;
+}
+
+bool crowRecordToFrame(const CrowRecord& record, CrowFrame& frame) {
+  if (record.kind != crowRecordFrame || record.length > crowRecordDataBytes) {
+    return false;
+  }
+  frame.length = record.length + 2;
+  frame.bytes[0] = 0x7E;
+  memcpy(frame.bytes + 1, record.data, record.length);
+  frame.bytes[record.length + 1] = 0x7E;
+  return true;
+}
+
+CrowRecord& CrowRecorder::append(uint8_t kind, uint32_t nowMs) {
+  CrowRecord& record = records[head];
+  head = (head + 1) & (crowRecorderSize - 1);
+  if (count < crowRecorderSize) {
+    count++;
+  }
+  record.timeMs = nowMs;
+  record.kind = kind;
+  recorded++;
+  dirty = true;
+  return record;
+}
+
+void CrowRecorder::recordFrame(const CrowFrame& frame, uint32_t nowMs) {
+  if (frame.length < 2) {
+    return;
+  }
+  const uint8_t* data = frame.bytes + 1;
+  uint8_t length = frame.length - 2;
+  uint8_t stored = length < crowRecordDataBytes ? length : crowRecordDataBytes;
+  uint8_t* last = lastFrames[crowFrameType(frame)];
+  if (last[0] == length && memcmp(last + 1, data, stored) == 0) {
+    repeatsSkipped++;
+    return;
+  }
+  last[0] = length;
+  memcpy(last + 1, data, stored);
+
+  CrowRecord& record = append(crowRecordFrame, nowMs);
+  record.length = length;
+  memcpy(record.data, data, stored);
+}
+
+void CrowRecorder::recordStatus(uint8_t previous, uint8_t status, uint32_t nowMs) {
+  CrowRecord& record = append(crowRecordStatus, nowMs);
+  record.length = 2;
+  record.data[0] = previous;
+  record.data[1] = status;
+  if (status == crowTriggered) {
+    urgent = true;
+  }
+}
+
+void CrowRecorder::recordCommand(const char* name, uint8_t outcome, uint8_t attempt, uint32_t nowMs) {
+  CrowRecord& record = append(crowRecordCommand, nowMs);
+  record.data[0] = outcome;
+  record.data[1] = attempt;
+  uint8_t length = 2;
+  while (length < crowRecordDataBytes && *name != '\0') {
+    record.data[length++] = *name++;
+  }
+  record.length = length;
+  if (outcome == crowCommandFailed) {
+    urgent = true;
+  }
+}
+
+void CrowRecorder::recordBoot(uint8_t resetReason, uint32_t nowMs) {
+  CrowRecord& record = append(crowRecordBoot, nowMs);
+  record.length = 1;
+  record.data[0] = resetReason;
+}
+
+uint8_t CrowRecorder::chunkCount() const {
+  return count == 0 ? 1 : (count + crowRecorderChunkRecords - 1) / crowRecorderChunkRecords;
+}
+
+size_t CrowRecorder::writeChunk(uint8_t index, uint32_t nowMs, uint8_t* out) const {
+  CrowRecorderChunkHeader header;
+  uint16_t first = index * crowRecorderChunkRecords;
+  header.magic[0] = 'C';
+  header.magic[1] = 'R';
+  header.version = chunkVersion;
+  header.index = index;
+  header.chunks = chunkCount();
+  header.count = first < count ? (count - first < crowRecorderChunkRecords ? count - first : crowRecorderChunkRecords) : 0;
+  header.total = count;
+  header.nowMs = nowMs;
+  memcpy(out, &header, sizeof(header));
+  CrowRecord* chunkRecords = (CrowRecord*)(out + sizeof(header));
+  for (uint8_t i = 0; i < header.count; i++) {
+    memcpy(&chunkRecords[i], &at(first + i), sizeof(CrowRecord));
+  }
+  return sizeof(header) + header.count * sizeof(CrowRecord);
+}
+
+bool CrowRecorder::begin() {
+  if (flash.sectorCount() < snapshotSectors) {
+    return false;
+  }
+  bool found = false;
+  SnapshotHeader best = {};
+  uint16_t bestSector = 0;
+  for (uint16_t sector = 0; sector < snapshotSectors; sector++) {
+    SnapshotHeader header;
+    if (!flash.read(sector * crowFlashSectorSize, (uint32_t*)&header, sizeof(header)) ||
+        header.magic != snapshotMagic || header.version != chunkVersion || header.count > crowRecorderSize) {
+      continue;
+    }
+    if (!found || header.sequence > best.sequence) {
+      found = true;
+      best = header;
+      bestSector = sector;
+    }
+  }
+  if (!found) {
+    return false;
+  }
+  nextSequence = best.sequence + 1;
+  if (!flash.read(bestSector * crowFlashSectorSize + sizeof(SnapshotHeader), (uint32_t*)records,
+                  best.count * sizeof(CrowRecord)) ||
+      fnv1a(fnvBasis, (const uint8_t*)records, best.count * sizeof(CrowRecord)) != best.checksum) {
+    return false;
+  }
+  count = best.count;
+  head = count & (crowRecorderSize - 1);
+  return true;
+}
+
+bool CrowRecorder::service(uint32_t nowMs) {
+  if (!dirty) {
+    return false;
+  }
+  uint32_t elapsed = nowMs - lastSnapshotMs;
+  if (elapsed < minSnapshotMs || (!urgent && elapsed < snapshotMs)) {
+    return false;
+  }
+  return snapshot(nowMs);
+}
+
+bool CrowRecorder::snapshot(uint32_t nowMs) {
+  if (flash.sectorCount() < snapshotSectors) {
+    return false;
+  }
+  lastSnapshotMs = nowMs;
+  dirty = false;
+  urgent = false;
+  uint16_t sector = nextSequence % snapshotSectors;
+  uint32_t base = sector * crowFlashSectorSize;
+  // The ring may wrap: write the older part first, then the newer one
+  uint16_t start = (head - count) & (crowRecorderSize - 1);
+  uint16_t firstSpan = count < crowRecorderSize - start ? count : crowRecorderSize - start;
+  SnapshotHeader header;
+  header.magic = snapshotMagic;
+  header.sequence = nextSequence++;
+  header.count = count;
+  header.version = chunkVersion;
+  header.checksum = fnv1a(fnv1a(fnvBasis, (const uint8_t*)&records[start], firstSpan * sizeof(CrowRecord)),
+                          (const uint8_t*)records, (count - firstSpan) * sizeof(CrowRecord));
+  // The header goes last, so a snapshot cut short is never taken as valid
+  bool ok = flash.eraseSector(sector) &&
+            flash.write(base + sizeof(header), (const uint32_t*)&records[start], firstSpan * sizeof(CrowRecord)) &&
+            (count == firstSpan ||
+             flash.write(base + sizeof(header) + firstSpan * sizeof(CrowRecord), (const uint32_t*)records,
+                         (count - firstSpan) * sizeof(CrowRecord))) &&
+            flash.write(base, (const uint32_t*)&header, sizeof(header));
+  if (!ok) {
+    snapshotErrors++;
+    return false;
+  }
+  snapshots++;
+  return true;
+}
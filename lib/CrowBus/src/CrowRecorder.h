@@ -0,0 +1,107 @@
+// Flight recorder of the last bus frames and events.
+// Fixed 16 byte records with a millis() timestamp go into a RAM ring. The
+// panel repeats the same status and zone frames all the time, so a frame is
+// only recorded when it differs from the last one of its kind. The ring is
+// snapshotted to flash (two sectors used in turn, so a power loss while
+// writing keeps the previous snapshot) and reloaded by begin(), so the events
+// before a restart are still there afterwards. dump chunks are what the
+// firmware publishes and crowtool reads back.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "CrowDecoder.h"
+#include "CrowDeframer.h"
+#include "CrowFlash.h"
+
+const uint16_t crowRecorderSize = 128;  // records, power of two
+const uint8_t crowRecordDataBytes = 10;
+
+enum CrowRecordKind : uint8_t {
+  crowRecordFrame,    // data: frame without its flags, length: bytes in it (may exceed data)
+  crowRecordStatus,   // data[0]: previous status, data[1]: new status
+  crowRecordCommand,  // data[0]: CrowCommandOutcome, data[1]: attempt, data[2..]: name
+  crowRecordBoot,     // data[0]: reset reason
+};
+
+struct CrowRecord {
+  uint32_t timeMs;  // millis(), restarts from 0 after each boot record
+  uint8_t kind;
+  uint8_t length;
+  uint8_t data[crowRecordDataBytes];
+};
+static_assert(sizeof(CrowRecord) == 16, "CrowRecord must stay 16 bytes, it is stored and dumped as is");
+
+// A dump is published as a series of chunks, each a header followed by its
+// records. Everything is little endian, as on the ESP8266.
+struct CrowRecorderChunkHeader {
+  uint8_t magic[2];  // "CR"
+  uint8_t version;
+  uint8_t index;     // chunk number within the dump
+  uint8_t chunks;    // chunks in the dump
+  uint8_t count;     // records in this chunk
+  uint16_t total;    // records in the dump
+  uint32_t nowMs;    // millis() at the time of the dump
+};
+const uint8_t crowRecorderChunkRecords = 32;
+const size_t crowRecorderChunkBytes = sizeof(CrowRecorderChunkHeader) + crowRecorderChunkRecords * sizeof(CrowRecord);
+
+// Parse one chunk at data. Returns its size, or 0 if data does not start
+// with a valid chunk.
+size_t crowReadRecorderChunk(const uint8_t* data, size_t length, CrowRecorderChunkHeader& header,
+                             const CrowRecord*& records);
+// Rebuild the flagged frame from a crowRecordFrame record. Returns false if
+// the frame was longer than what the record holds.
+bool crowRecordToFrame(const CrowRecord& record, CrowFrame& frame);
+
+class CrowRecorder {
+ public:
+  explicit CrowRecorder(CrowFlashRegion& flash) : flash(flash) {}
+
+  // Load the newest snapshot from flash. Returns false if there is none.
+  bool begin();
+
+  void recordFrame(const CrowFrame& frame, uint32_t nowMs);
+  void recordStatus(uint8_t previous, uint8_t status, uint32_t nowMs);
+  void recordCommand(const char* name, uint8_t outcome, uint8_t attempt, uint32_t nowMs);
+  void recordBoot(uint8_t resetReason, uint32_t nowMs);
+
+  uint16_t size() const { return count; }
+  // Records in order, 0 is the oldest
+  const CrowRecord& at(uint16_t index) const {
+    return records[(head - count + index) & (crowRecorderSize - 1)];
+  }
+
+  uint8_t chunkCount() const;
+  // Fill out (crowRecorderChunkBytes) with chunk index. Returns its length.
+  size_t writeChunk(uint8_t index, uint32_t nowMs, uint8_t* out) const;
+
+  // Call from loop(). Snapshots new records every snapshotMs, or sooner
+  // (but not more often than minSnapshotMs) after an alarm or a failed
+  // command. Returns true if a snapshot was written.
+  bool service(uint32_t nowMs);
+  // Write a snapshot now, e.g. before a restart
+  bool snapshot(uint32_t nowMs);
+
+  uint32_t snapshotMs = 900000;
+  uint32_t minSnapshotMs = 60000;
+
+  uint32_t recorded = 0;      // records added since boot
+  uint32_t repeatsSkipped = 0;
+  uint32_t snapshots = 0;
+  uint32_t snapshotErrors = 0;
+
+ private:
+  CrowRecord& append(uint8_t kind, uint32_t nowMs);
+
+  CrowFlashRegion& flash;
+  CrowRecord records[crowRecorderSize];
+  uint16_t head = 0;
+  uint16_t count = 0;
+  // Last recorded frame per CrowFrameType
+  uint8_t lastFrames[crowFrameTypeCount][crowRecordDataBytes + 1] = {};
+  bool dirty = false;
+  bool urgent = false;
+  uint32_t lastSnapshotMs = 0;
+  uint32_t nextSequence = 1;
+};
@@ -0,0 +1,289 @@
+#include "CrowRules.h"
+
+#include <string.h>
+#include "CrowKeypad.h"
+
+// Header of the stored rule text, written after the text
+struct RulesHeader {
+  uint32_t magic;
+  uint16_t length;
+  uint16_t reserved;
+  uint32_t checksum;
+};
+static_assert(sizeof(RulesHeader) % 4 == 0, "rule text must stay word aligned");
+static const uint32_t rulesMagic = 0x454C5552;  // "RULE"
+static const uint8_t maxStatus = 6;
+
+static uint32_t fnv1a(const uint8_t* data, size_t length) {
+  uint32_t hash = 2166136261u;
+  while (length--) {
+    hash = (hash ^ *data++) * 16777619u;
+  }
+  return hash;
+}
+
+static bool isBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parse an unsigned number at p, moving p past it
+static bool parseNumber(const char*& p, const char* end, uint32_t& value) {
+  if (p == end || *p < '0' || *p > '9') {
+    return false;
+  }
+  value = 0;
+  while (p < end && *p >= '0' && *p <= '9' && value < 100000) {
+    value = value * 10 + (*p++ - '0');
+  }
+  return true;
+}
+
+static bool startsWith(const char*& p, const char* end, const char* word) {
+  size_t length = strlen(word);
+  if ((size_t)(end - p) < length || memcmp(p, word, length) != 0) {
+    return false;
+  }
+  p += length;
+  return true;
+}
+
+static bool parseTrigger(const char*& p, const char* end, CrowRule& rule) {
+  if (startsWith(p, end, "status:")) {
+    uint32_t status;
+    if (!parseNumber(p, end, status) || status > maxStatus) {
+      return false;
+    }
+    rule.trigger = crowRuleStatus;
+    rule.status = status;
+  } else {
+    if (startsWith(p, end, "activo:")) {
+      rule.trigger = crowRuleActive;
+    } else if (startsWith(p, end, "triggered:")) {
+      rule.trigger = crowRuleTriggered;
+    } else {
+      return false;
+    }
+    for (;;) {
+      uint32_t zone;
+      if (!parseNumber(p, end, zone) || zone < 1 || zone > 16) {
+        return false;
+      }
+      rule.zones |= 1u << (zone - 1);
+      if (p == end || *p != ',') {
+        break;
+      }
+      p++;
+    }
+  }
+  rule.whileStatus = crowRuleAnyStatus;
+  if (p < end && *p == '@') {
+    uint32_t status;
+    p++;
+    if (!parseNumber(p, end, status) || status > maxStatus) {
+      return false;
+    }
+    rule.whileStatus = status;
+  }
+  return true;
+}
+
+static bool parseAction(const char* p, const char* end, const char* const* relayNames, uint8_t relayCount,
+                        CrowRule& rule) {
+  if (startsWith(p, end, "keys:")) {
+    rule.action = crowRuleKeys;
+    for (; p < end; p++) {
+      uint8_t key;
+      if (*p >= '0' && *p <= '9') {
+        key = *p - '0';
+      } else if (*p == 'e') {
+        key = crowKeyEnter;
+      } else if (*p == 't') {
+        key = crowKeyTotal;
+      } else if (*p == 'p') {
+        key = crowKeyParcial;
+      } else if (*p == 'a') {
+        key = crowKeyPanic;
+      } else {
+        return false;
+      }
+      if (rule.keyCount == crowRuleMaxKeys) {
+        return false;
+      }
+      rule.keys[rule.keyCount++] = key;
+    }
+    return rule.keyCount > 0;
+  }
+  const char* name = p;
+  while (p < end && *p != ':') {
+    p++;
+  }
+  for (uint8_t relay = 0; relay < relayCount; relay++) {
+    if (strlen(relayNames[relay]) == (size_t)(p - name) && memcmp(relayNames[relay], name, p - name) == 0) {
+      char options[16];
+      size_t length = p < end ? end - p - 1 : 0;
+      if (length >= sizeof(options)) {
+        return false;
+      }
+      memcpy(options, end - length, length);
+      options[length] = '\0';
+      rule.action = crowRuleRelay;
+      rule.relay = relay;
+      return crowParsePulseOptions(options, rule.pulse);
+    }
+  }
+  return false;
+}
+
+bool CrowRuleEngine::load(const char* text, size_t length, const char* const* relayNames, uint8_t relayCount,
+                          uint16_t& errorLine) {
+  CrowRule parsed[crowMaxRules];
+  uint8_t parsedCount = 0;
+  const char* end = text + length;
+  errorLine = 0;
+  for (const char* line = text; line < end;) {
+    const char* lineEnd = line;
+    while (lineEnd < end && *lineEnd != '\n' && *lineEnd != ';') {
+      lineEnd++;
+    }
+    errorLine++;
+    const char* p = line;
+    const char* last = lineEnd;
+    line = lineEnd + 1;
+    while (p < last && isBlank(*p)) {
+      p++;
+    }
+    while (last > p && isBlank(last[-1])) {
+      last--;
+    }
+    if (p == last || *p == '#') {
+      continue;
+    }
+    if (parsedCount == crowMaxRules) {
+      return false;
+    }
+    CrowRule& rule = parsed[parsedCount];
+    memset(&rule, 0, sizeof(rule));
+    if (!parseTrigger(p, last, rule) || p == last || !isBlank(*p)) {
+      return false;
+    }
+    while (p < last && isBlank(*p)) {
+      p++;
+    }
+    if (!parseAction(p, last, relayNames, relayCount, rule)) {
+      return false;
+    }
+    parsedCount++;
+  }
+  errorLine = 0;
+  memcpy(rules, parsed, parsedCount * sizeof(CrowRule));
+  memset(stats, 0, sizeof(stats));
+  count = parsedCount;
+  return true;
+}
+
+void CrowRuleEngine::clear() {
+  count = 0;
+  memset(stats, 0, sizeof(stats));
+}
+
+// Expire the zones not reported for zoneHoldMs, take in the frame and return
+// the zones that became set
+uint16_t CrowRuleEngine::updateZones(uint16_t zoneMask, uint16_t& last, uint16_t incoming, uint32_t* lastSeen,
+                                     uint32_t nowMs) {
+  incoming &= zoneMask;
+  for (uint8_t zone = 0; zone < 16; zone++) {
+    uint16_t bit = 1u << zone;
+    if ((last & bit) && nowMs - lastSeen[zone] >= zoneHoldMs) {
+      last &= ~bit;
+    }
+    if (incoming & bit) {
+      lastSeen[zone] = nowMs;
+    }
+  }
+  uint16_t rising = incoming & ~last;
+  last = (last & ~zoneMask) | incoming;
+  return rising;
+}
+
+void CrowRuleEngine::onZones(uint16_t zoneMask, uint16_t activeZones, uint16_t triggeredZones, uint32_t nowMs) {
+  uint16_t newActive = updateZones(zoneMask, lastActive, activeZones, activeSeenMs, nowMs);
+  uint16_t newTriggered = updateZones(zoneMask, lastTriggered, triggeredZones, triggeredSeenMs, nowMs);
+  if (newActive != 0) {
+    evaluate(crowRuleActive, newActive, 0);
+  }
+  if (newTriggered != 0) {
+    evaluate(crowRuleTriggered, newTriggered, 0);
+  }
+}
+
+void CrowRuleEngine::onStatus(uint8_t newStatus) {
+  if (newStatus == status) {
+    return;
+  }
+  // The first status seen after a restart is not a change. "@<status>"
+  // rules see the status the panel left.
+  if (status != crowRuleAnyStatus) {
+    evaluate(crowRuleStatus, 0, newStatus);
+  }
+  status = newStatus;
+}
+
+void CrowRuleEngine::evaluate(uint8_t trigger, uint16_t changedZones, uint8_t newStatus) {
+  for (uint8_t i = 0; i < count; i++) {
+    uint32_t start = clock();
+    const CrowRule& rule = rules[i];
+    CrowRuleStats& stat = stats[i];
+    bool fire = rule.trigger == trigger &&
+                (rule.whileStatus == crowRuleAnyStatus || rule.whileStatus == status) &&
+                (trigger == crowRuleStatus ? rule.status == newStatus : (rule.zones & changedZones) != 0);
+    if (fire) {
+      stat.fired++;
+      if (onAction != nullptr) {
+        onAction(*this, i, rule);
+      }
+    }
+    uint32_t took = clock() - start;
+    stat.evaluations++;
+    stat.totalCycles += took;
+    if (took > stat.maxCycles) {
+      stat.maxCycles = took;
+    }
+  }
+}
+
+// Word buffer for flash transfers of the rule text
+static uint32_t textWords[(crowRulesTextBytes + 3) / 4];
+
+size_t crowLoadRules(CrowFlashRegion& flash, char* text, size_t size) {
+  RulesHeader header;
+  if (flash.sectorCount() == 0 || !flash.read(0, (uint32_t*)&header, sizeof(header)) ||
+      header.magic != rulesMagic || header.length > crowRulesTextBytes || header.length >= size ||
+      !flash.read(sizeof(header), textWords, (header.length + 3) & ~3u) ||
+      fnv1a((const uint8_t*)textWords, header.length) != header.checksum) {
+    return 0;
+  }
+  memcpy(text, textWords, header.length);
+  text[header.length] = '\0';
+  return header.length;
+}
+
+bool crowSaveRules(CrowFlashRegion& flash, const char* text, size_t length) {
+  if (flash.sectorCount() == 0 || length > crowRulesTextBytes) {
+    return false;
+  }
+  uint32_t checksum = fnv1a((const uint8_t*)text, length);
+  RulesHeader header;
+  if (flash.read(0, (uint32_t*)&header, sizeof(header)) && header.magic == rulesMagic && header.length == length &&
+      header.checksum == checksum) {
+    return true;  // already stored, e.g. a retained message delivered again
+  }
+  memset(textWords, 0xFF, sizeof(textWords));
+  memcpy(textWords, text, length);
+  header.magic = rulesMagic;
+  header.length = length;
+  header.reserved = 0xFFFF;
+  header.checksum = checksum;
+  // The header goes last, so text cut short by a reset is never loaded
+  return flash.eraseSector(0) && (length == 0 || flash.write(sizeof(header), textWords, (length + 3) & ~3u)) &&
+         flash.write(0, (const uint32_t*)&header, sizeof(header));
+}
@@ -0,0 +1,110 @@
+// Local automation rules, evaluated right where frames are decoded so a zone
+// or status change can pulse a relay or send keys without a round trip
+// through the broker, and while the network is down.
+//
+// Rules are given as text, one per line (or separated by ';'):
+//
+//   <trigger>[@<status>] <action>
+//
+// Triggers: "activo:<zones>" and "triggered:<zones>" fire when any of the
+// comma separated zones (1 to 16) becomes active or triggered,
+// "status:<status>" when the panel enters that status (0 to 6, as in
+// crowStatusName()). "@<status>" only lets the rule fire if the panel was
+// in that status at the time, e.g. "triggered:3@1" only while armed total.
+//
+// Actions: a relay command with the usual pulse options ("alarmepin",
+// "totalpin:300x2"), or "keys:<keys>" with digits and e (enter), t (total),
+// p (parcial) and a (panic), e.g. "keys:e1234e".
+//
+// Blank lines and lines starting with '#' are ignored.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "CrowFlash.h"
+#include "CrowPulse.h"
+
+const uint8_t crowMaxRules = 16;
+const uint8_t crowRuleMaxKeys = 8;
+const size_t crowRulesTextBytes = 1024;  // longest rule text that is stored
+const uint8_t crowRuleAnyStatus = 0xFF;
+
+enum CrowRuleTrigger : uint8_t {
+  crowRuleActive,     // a zone became active
+  crowRuleTriggered,  // a zone became triggered
+  crowRuleStatus,     // the panel entered a status
+};
+
+enum CrowRuleAction : uint8_t {
+  crowRuleRelay,
+  crowRuleKeys,
+};
+
+struct CrowRule {
+  uint8_t trigger;
+  uint8_t whileStatus;  // status the panel must be in, crowRuleAnyStatus for any
+  uint16_t zones;       // bit n = zone n + 1, for zone triggers
+  uint8_t status;       // status entered, for status triggers
+  uint8_t action;
+  uint8_t relay;        // index into the relay names given to load()
+  uint8_t keyCount;
+  CrowPulsePattern pulse;
+  uint8_t keys[crowRuleMaxKeys];
+};
+
+struct CrowRuleStats {
+  uint32_t evaluations;
+  uint32_t fired;
+  uint32_t totalCycles;  // evaluation cost, including running the action
+  uint32_t maxCycles;
+
+  uint32_t averageCycles() const { return evaluations ? totalCycles / evaluations : 0; }
+};
+
+class CrowRuleEngine {
+ public:
+  explicit CrowRuleEngine(uint32_t (*clock)()) : clock(clock) {}
+
+  // Replace the rules with the ones in text. relayNames are the relay
+  // commands accepted as actions, in relay index order. On error the current
+  // rules are kept and errorLine is the (1 based) line that failed.
+  bool load(const char* text, size_t length, const char* const* relayNames, uint8_t relayCount,
+            uint16_t& errorLine);
+  void clear();
+
+  // Feed every decoded zone frame and status; rules fire on the changes.
+  // zoneMask is the zones the frame reports on. A zone not reported for
+  // zoneHoldMs is taken as closed, as in CrowEventFilter, so it fires again
+  // when the panel reports it after a silence.
+  void onZones(uint16_t zoneMask, uint16_t activeZones, uint16_t triggeredZones, uint32_t nowMs);
+  void onStatus(uint8_t status);  // the first one after a restart only sets the status
+
+  uint16_t zoneHoldMs = 3000;
+
+  uint8_t size() const { return count; }
+  const CrowRule& rule(uint8_t i) const { return rules[i]; }
+  const CrowRuleStats& ruleStats(uint8_t i) const { return stats[i]; }
+
+  // Called for every rule that fires, with its index
+  void (*onAction)(CrowRuleEngine& engine, uint8_t index, const CrowRule& rule) = nullptr;
+
+ private:
+  void evaluate(uint8_t trigger, uint16_t changedZones, uint8_t newStatus);
+  uint16_t updateZones(uint16_t zoneMask, uint16_t& last, uint16_t incoming, uint32_t* lastSeen, uint32_t nowMs);
+
+  uint32_t (*clock)();
+  CrowRule rules[crowMaxRules] = {};
+  CrowRuleStats stats[crowMaxRules] = {};
+  uint8_t count = 0;
+  uint16_t lastActive = 0;
+  uint16_t lastTriggered = 0;
+  uint32_t activeSeenMs[16] = {};
+  uint32_t triggeredSeenMs[16] = {};
+  uint8_t status = crowRuleAnyStatus;  // unknown until the first status frame
+};
+
+// Rule text storage in the first sector of a flash region. crowSaveRules()
+// leaves the flash alone when the same text is already stored.
+bool crowSaveRules(CrowFlashRegion& flash, const char* text, size_t length);
+// Returns the text length, 0 if nothing valid is stored
+size_t crowLoadRules(CrowFlashRegion& flash, char* text, size_t size);
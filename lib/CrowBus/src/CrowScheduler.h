@@ -0,0 +1,115 @@
+// Cooperative scheduler for loop() over a static task table.
+// Each pass runs, in table order, every task that is due: periodic tasks when
+// their period has elapsed, triggered tasks when their trigger returns true,
+// the rest on every pass. Runtime (max and average), start latency and budget
+// overruns are kept per task for the telemetry.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct CrowTask {
+  const char* name;
+  void (*run)();
+  uint32_t periodMs;  // run every periodMs; 0 to run on every pass
+  bool (*trigger)();  // with periodMs 0: only run when this returns true
+  uint32_t budgetUs;  // runs taking longer are overruns
+};
+
+struct CrowTaskStats {
+  uint32_t runs;
+  uint64_t totalUs;
+  uint32_t maxUs;
+  // Worst delay between the task becoming due and it starting. For tasks
+  // without a period, the longest time between two checks.
+  uint32_t maxLatencyUs;
+  uint32_t overruns;
+  uint32_t lastUs;   // when it last ran (periodic) or was checked
+  uint32_t warnedUs;
+  bool warned;
+
+  uint32_t averageUs() const { return runs ? totalUs / runs : 0; }
+};
+
+template <size_t N>
+class CrowScheduler {
+ public:
+  CrowScheduler(const CrowTask (&tasks)[N], uint32_t (*clockUs)()) : tasks(tasks), clockUs(clockUs) {}
+
+  // Start the periods from now
+  void begin() {
+    uint32_t now = clockUs();
+    for (CrowTaskStats& task : stats) {
+      task.lastUs = now;
+    }
+  }
+
+  // One pass over the table, call from loop()
+  void runOnce() {
+    uint32_t passStart = clockUs();
+    for (size_t i = 0; i < N; i++) {
+      const CrowTask& task = tasks[i];
+      CrowTaskStats& stat = stats[i];
+      uint32_t now = clockUs();
+      uint32_t latency;
+      if (task.periodMs != 0) {
+        uint32_t sinceLast = now - stat.lastUs;
+        if (sinceLast < task.periodMs * 1000) {
+          continue;
+        }
+        latency = sinceLast - task.periodMs * 1000;
+        // Keep to the period rather than drifting by the latency, unless
+        // a whole period was missed
+        stat.lastUs = latency < task.periodMs * 1000 ? now - latency : now;
+      } else {
+        latency = now - stat.lastUs;
+        stat.lastUs = now;
+        if (task.trigger != nullptr && !task.trigger()) {
+          if (latency > stat.maxLatencyUs) {
+            stat.maxLatencyUs = latency;
+          }
+          continue;
+        }
+      }
+      if (latency > stat.maxLatencyUs) {
+        stat.maxLatencyUs = latency;
+      }
+      task.run();
+      uint32_t took = clockUs() - now;
+      stat.runs++;
+      stat.totalUs += took;
+      if (took > stat.maxUs) {
+        stat.maxUs = took;
+      }
+      if (task.budgetUs != 0 && took > task.budgetUs) {
+        stat.overruns++;
+        if (onOverrun != nullptr && (!stat.warned || now - stat.warnedUs >= warnIntervalMs * 1000)) {
+          stat.warned = true;
+          stat.warnedUs = now;
+          onOverrun(task, took);
+        }
+      }
+    }
+    uint32_t passTime = clockUs() - passStart;
+    if (passTime > passMaxUs) {
+      passMaxUs = passTime;
+    }
+    passes++;
+  }
+
+  static constexpr size_t size() { return N; }
+  const CrowTask& task(size_t i) const { return tasks[i]; }
+  const CrowTaskStats& taskStats(size_t i) const { return stats[i]; }
+
+  // Called after a run over budget, at most once per warnIntervalMs per task
+  void (*onOverrun)(const CrowTask& task, uint32_t tookUs) = nullptr;
+  uint32_t warnIntervalMs = 60000;
+
+  uint32_t passes = 0;
+  uint32_t passMaxUs = 0;
+
+ private:
+  const CrowTask (&tasks)[N];
+  uint32_t (*clockUs)();
+  CrowTaskStats stats[N] = {};
+};
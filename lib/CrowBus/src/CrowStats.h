@@ -0,0 +1,62 @@
+// Lock-free instrumentation for the bus path.
+// Each histogram has a single writer (the ISR or loop()) and is only read
+// elsewhere, so plain volatile 32-bit counters are enough on the ESP8266.
+#pragma once
+
+#include <stdint.h>
+#include "CrowPlatform.h"
+
+// Power-of-two histogram of cycle counts. Bucket 0 holds values below
+// 2^FirstShift, bucket n values below 2^(FirstShift + n), and the last bucket
+// everything above.
+template <uint8_t Buckets, uint8_t FirstShift>
+class CrowHistogram {
+  static_assert(Buckets >= 2 && FirstShift + Buckets <= 32, "histogram buckets out of range");
+
+ public:
+  CROW_ALWAYS_INLINE void record(uint32_t value) {
+    // No __builtin_clz: on the lx106 that is a libgcc call living in flash
+    uint8_t bucket = 0;
+    uint32_t scaled = value >> FirstShift;
+    while (scaled != 0 && bucket < Buckets - 1) {
+      scaled >>= 1;
+      bucket++;
+    }
+    counts[bucket] = counts[bucket] + 1;
+    if (value > maxValue) {
+      maxValue = value;
+    }
+  }
+
+  uint32_t count(uint8_t bucket) const { return counts[bucket]; }
+  uint32_t max() const { return maxValue; }
+  // Exclusive upper bound of a bucket, 0 for the open-ended last one
+  static uint32_t limit(uint8_t bucket) {
+    return bucket < Buckets - 1 ? 1ul << (FirstShift + bucket) : 0;
+  }
+  static constexpr uint8_t buckets() { return Buckets; }
+
+ private:
+  volatile uint32_t counts[Buckets] = {};
+  volatile uint32_t maxValue = 0;
+};
+
+// Events per second over the interval between two calls to update()
+class CrowRateMeter {
+ public:
+  uint32_t update(uint32_t total, uint32_t nowMs) {
+    uint32_t elapsed = nowMs - lastMs;
+    if (elapsed > 0) {
+      lastRate = (uint32_t)((uint64_t)(total - lastTotal) * 1000 / elapsed);
+    }
+    lastTotal = total;
+    lastMs = nowMs;
+    return lastRate;
+  }
+  uint32_t rate() const { return lastRate; }
+
+ private:
+  uint32_t lastTotal = 0;
+  uint32_t lastMs = 0;
+  uint32_t lastRate = 0;
+};
@@ -0,0 +1,143 @@
+// Status frame state machine as a compile-time generated transition table.
+// The six status bits of a frame plus the previous status index a 512 entry
+// table, so decoding a status frame is a single lookup. The table is built
+// from crowStatusRules (first match wins) and checked exhaustively at compile
+// time against crowLegacyNextStatus(), the original if/else cascade.
+//
+// To support a new panel state: add a rule, then update the reference
+// function to match, and the static_assert in CrowDecoder.cpp will confirm
+// that nothing else changed.
+#pragma once
+
+#include <stdint.h>
+#include "CrowDecoder.h"
+
+// Status bits, packed as crowStatusInputs() returns them
+const uint8_t crowInStatu3 = 0x01;    // bytes[3] bit 4
+const uint8_t crowInJaarmado = 0x02;  // bytes[3] bit 5, already armed
+const uint8_t crowInStatu2 = 0x04;    // bytes[3] bit 6
+const uint8_t crowInStatu1 = 0x08;    // bytes[3] bit 7
+const uint8_t crowInTotal = 0x10;     // bytes[6] bit 7, armed totally
+const uint8_t crowInParcial = 0x20;   // bytes[7] bit 7, armed partially
+const uint8_t crowStatusInputCount = 64;
+const uint8_t crowStatusPrevCount = 8;  // previous status 0-6, 7 for anything else
+
+inline uint8_t crowStatusInputs(const CrowPanelFrame& frame) {
+  return frame.statusBits() | (frame.armedTotal() ? crowInTotal : 0) | (frame.armedPartial() ? crowInParcial : 0);
+}
+
+// The if/else cascade printBuffer() used to run. Reference only.
+constexpr uint8_t crowLegacyNextStatus(uint8_t inputs, uint8_t status) {
+  bool statu1 = inputs & crowInStatu1;
+  bool statu2 = inputs & crowInStatu2;
+  bool jaarmado = inputs & crowInJaarmado;
+  bool statu3 = inputs & crowInStatu3;
+  bool total = inputs & crowInTotal;
+  bool parcial = inputs & crowInParcial;
+
+  if (statu1 && statu2 && statu3) { //triggered
+    return jaarmado ? crowTriggered : crowChime;
+  } else if (statu1 && !statu2 && jaarmado) { //disarmed
+    return crowDisarmed;
+  } else if (parcial && status != crowTriggered) { //armed partially rather than totally
+    if ((!statu2 && jaarmado) || (statu1 && !statu3 && status != crowArmingPartial)) {
+      return crowArmedPartial;
+    } else if (status != crowArmedPartial) {
+      return crowArmingPartial;
+    }
+  } else if (total && status != crowTriggered) {
+    if ((!statu2 && jaarmado) || (statu1 && !statu3 && status != crowArmingTotal)) {
+      return crowArmedTotal;
+    } else if (status != crowArmedTotal) {
+      return crowArmingTotal;
+    }
+  } else if (status != crowTriggered) { //disarmed
+    return crowDisarmed;
+  } else if (!statu1) { //disarm successful
+    return crowDisarmed;
+  }
+  return status;
+}
+
+const uint8_t crowStatusKeep = 0xFF;  // rule result: previous status stays
+
+struct CrowStatusRule {
+  uint8_t mask;        // inputs that must match
+  uint8_t value;       // their required value
+  uint8_t fromStatus;  // bitmask of previous statuses the rule applies to
+  uint8_t next;        // new status or crowStatusKeep
+};
+
+constexpr uint8_t crowAnyStatus = 0xFF;
+constexpr uint8_t crowStatusBit(uint8_t status) {
+  return 1u << status;
+}
+
+// Ordered, first match wins
+constexpr CrowStatusRule crowStatusRules[] = {
+  // statu1, statu2 and statu3: alarm triggered if it was armed, otherwise chime
+  {crowInStatu1 | crowInStatu2 | crowInStatu3 | crowInJaarmado,
+   crowInStatu1 | crowInStatu2 | crowInStatu3 | crowInJaarmado, crowAnyStatus, crowTriggered},
+  {crowInStatu1 | crowInStatu2 | crowInStatu3, crowInStatu1 | crowInStatu2 | crowInStatu3, crowAnyStatus, crowChime},
+  // statu1 without statu2 after being armed: disarmed
+  {crowInStatu1 | crowInStatu2 | crowInJaarmado, crowInStatu1 | crowInJaarmado, crowAnyStatus, crowDisarmed},
+  // Partial arming, unless the alarm went off
+  {crowInParcial | crowInStatu2 | crowInJaarmado, crowInParcial | crowInJaarmado,
+   (uint8_t)~crowStatusBit(crowTriggered), crowArmedPartial},
+  {crowInParcial | crowInStatu1 | crowInStatu3, crowInParcial | crowInStatu1,
+   (uint8_t)~(crowStatusBit(crowTriggered) | crowStatusBit(crowArmingPartial)), crowArmedPartial},
+  {crowInParcial, crowInParcial, (uint8_t)~(crowStatusBit(crowTriggered) | crowStatusBit(crowArmedPartial)),
+   crowArmingPartial},
+  {crowInParcial, crowInParcial, (uint8_t)~crowStatusBit(crowTriggered), crowStatusKeep},
+  // Total arming, unless the alarm went off
+  {crowInTotal | crowInStatu2 | crowInJaarmado, crowInTotal | crowInJaarmado,
+   (uint8_t)~crowStatusBit(crowTriggered), crowArmedTotal},
+  {crowInTotal | crowInStatu1 | crowInStatu3, crowInTotal | crowInStatu1,
+   (uint8_t)~(crowStatusBit(crowTriggered) | crowStatusBit(crowArmingTotal)), crowArmedTotal},
+  {crowInTotal, crowInTotal, (uint8_t)~(crowStatusBit(crowTriggered) | crowStatusBit(crowArmedTotal)),
+   crowArmingTotal},
+  {crowInTotal, crowInTotal, (uint8_t)~crowStatusBit(crowTriggered), crowStatusKeep},
+  // Nothing armed: disarmed, and after an alarm only once statu1 clears
+  {0, 0, (uint8_t)~crowStatusBit(crowTriggered), crowDisarmed},
+  {crowInStatu1, 0, crowAnyStatus, crowDisarmed},
+};
+
+struct CrowStatusTable {
+  uint8_t next[crowStatusPrevCount * crowStatusInputCount];
+
+  uint8_t lookup(uint8_t inputs, uint8_t previous) const {
+    uint8_t prev = previous < crowStatusPrevCount ? previous : crowStatusPrevCount - 1;
+    return next[(prev << 6) | inputs];
+  }
+};
+
+constexpr uint8_t crowApplyStatusRules(uint8_t inputs, uint8_t previous) {
+  for (const CrowStatusRule& rule : crowStatusRules) {
+    if ((inputs & rule.mask) == rule.value && (rule.fromStatus & crowStatusBit(previous))) {
+      return rule.next == crowStatusKeep ? previous : rule.next;
+    }
+  }
+  return previous;
+}
+
+constexpr CrowStatusTable crowBuildStatusTable() {
+  CrowStatusTable table = {};
+  for (uint8_t prev = 0; prev < crowStatusPrevCount; prev++) {
+    for (uint8_t inputs = 0; inputs < crowStatusInputCount; inputs++) {
+      table.next[(prev << 6) | inputs] = crowApplyStatusRules(inputs, prev);
+    }
+  }
+  return table;
+}
+
+// Every (inputs, previous status) combination against the reference cascade
+constexpr bool crowStatusTableMatchesLegacy(const CrowStatusTable& table) {
+  for (uint8_t prev = 0; prev < crowStatusPrevCount; prev++) {
+    for (uint8_t inputs = 0; inputs < crowStatusInputCount; inputs++) {
+      if (table.next[(prev << 6) | inputs] != crowLegacyNextStatus(inputs, prev)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,123 @@
+// Interrupt-driven transmitter for the Crow keypad bus.
+// loop() queues packets; the clock ISR calls onClockEdge() on every falling
+// edge and drives the returned level on the data line, so no code ever polls
+// the clock. Packets are sent as raw bytes (no bit stuffing), MSB first,
+// followed by a 0 and a 1 before the line is released, as the keypads do.
+#pragma once
+
+#include <stdint.h>
+#include "SpscRing.h"
+
+const uint8_t crowMaxTxPacketBytes = 8;
+const uint16_t crowTxQueueSize = 16;
+
+struct CrowTxPacket {
+  uint8_t length;
+  bool backToBack;  // part of a sequence: skip gapTicks, just wait for an idle bus
+  uint8_t bytes[crowMaxTxPacketBytes];
+  uint32_t queuedAt;
+};
+
+// What the ISR has to do with the data line on this clock edge
+enum CrowTxLine : uint8_t {
+  crowTxNone,     // not transmitting, leave the pin alone
+  crowTxLow,      // drive 0
+  crowTxHigh,     // drive 1
+  crowTxRelease,  // packet done, switch the pin back to input
+};
+
+class CrowTransmitter {
+ public:
+  // Producer side, from loop(). now is in the same ticks passed to
+  // onClockEdge() (CPU cycles on the ESP). Returns false if the queue is full.
+  bool queuePacket(const uint8_t* bytes, uint8_t length, uint32_t now, bool backToBack = false) {
+    CrowTxPacket packet;
+    if (length == 0 || length > crowMaxTxPacketBytes) {
+      return false;
+    }
+    packet.length = length;
+    packet.backToBack = backToBack;
+    for (uint8_t i = 0; i < length; i++) {
+      packet.bytes[i] = bytes[i];
+    }
+    packet.queuedAt = now;
+    if (!queue.push(packet)) {
+      packetsDropped++;
+      return false;
+    }
+    uint16_t depth = queue.size();
+    if (depth > queueMax) {
+      queueMax = depth;
+    }
+    return true;
+  }
+
+  // Consumer side, from the clock ISR on every falling edge. busIdle tells
+  // whether the line has been idle long enough to start a new packet.
+  CROW_ALWAYS_INLINE CrowTxLine onClockEdge(bool busIdle, uint32_t now) {
+    if (phase == phaseIdle) {
+      const CrowTxPacket* next = queue.front();
+      if (!busIdle || next == nullptr ||
+          (!next->backToBack && (uint32_t)(now - lastDoneAt) < gapTicks)) {
+        return crowTxNone;
+      }
+      queue.pop(current);
+      phase = phaseData;
+      bitIndex = 0;
+    }
+    switch (phase) {
+      case phaseData: {
+        uint8_t bit = (current.bytes[bitIndex >> 3] >> (7 - (bitIndex & 7))) & 1;
+        if (++bitIndex == current.length * 8) {
+          phase = phaseTrailerLow;
+        }
+        return bit ? crowTxHigh : crowTxLow;
+      }
+      case phaseTrailerLow:
+        // Send a final 0
+        phase = phaseTrailerHigh;
+        return crowTxLow;
+      case phaseTrailerHigh:
+        // Ensure data line stays high
+        phase = phaseRelease;
+        return crowTxHigh;
+      default: {
+        phase = phaseIdle;
+        lastDoneAt = now;
+        uint32_t latency = now - current.queuedAt;
+        lastLatency = latency;
+        if (latency > maxLatency) {
+          maxLatency = latency;
+        }
+        packetsSent = packetsSent + 1;
+        return crowTxRelease;
+      }
+    }
+  }
+
+  bool busy() const {
+    return phase != phaseIdle || !queue.empty();
+  }
+
+  uint16_t queued() const {
+    return queue.size();
+  }
+
+  // Minimum ticks between the end of one packet and the start of the next
+  uint32_t gapTicks = 0;
+
+  volatile uint32_t packetsSent = 0;
+  volatile uint32_t lastLatency = 0;  // ticks from queuePacket() to release of the line
+  volatile uint32_t maxLatency = 0;
+  uint32_t packetsDropped = 0;        // queue was full
+  uint16_t queueMax = 0;
+
+ private:
+  enum Phase : uint8_t { phaseIdle, phaseData, phaseTrailerLow, phaseTrailerHigh, phaseRelease };
+
+  SpscRing<CrowTxPacket, crowTxQueueSize> queue;
+  CrowTxPacket current;
+  volatile Phase phase = phaseIdle;
+  uint8_t bitIndex = 0;
+  uint32_t lastDoneAt = 0;
+};
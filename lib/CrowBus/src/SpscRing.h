@@ -0,0 +1,65 @@
+// Fixed-size, allocation-free single-producer/single-consumer ring buffer.
+// One side (usually an ISR) only calls push(), the other (usually loop()) only
+// calls pop(). Each index is written by exactly one side, so no locking is
+// needed on the single-core ESP8266 - only a compiler barrier between the
+// slot access and the index update.
+#pragma once
+
+#include <stdint.h>
+#include "CrowPlatform.h"
+
+template <typename T, uint16_t N>
+class SpscRing {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+ public:
+  // Producer side. Returns false (and stores nothing) when the ring is full.
+  CROW_ALWAYS_INLINE bool push(const T& value) {
+    uint16_t h = head;
+    if ((uint16_t)(h - tail) >= N) {
+      return false;
+    }
+    items[h & (N - 1)] = value;
+    __asm__ __volatile__("" ::: "memory");
+    head = h + 1;
+    return true;
+  }
+
+  // Consumer side. Returns false when the ring is empty.
+  CROW_ALWAYS_INLINE bool pop(T& value) {
+    uint16_t t = tail;
+    if (t == head) {
+      return false;
+    }
+    value = items[t & (N - 1)];
+    __asm__ __volatile__("" ::: "memory");
+    tail = t + 1;
+    return true;
+  }
+
+  // Consumer side. Oldest item without removing it, nullptr when empty.
+  CROW_ALWAYS_INLINE const T* front() const {
+    uint16_t t = tail;
+    if (t == head) {
+      return nullptr;
+    }
+    return &items[t & (N - 1)];
+  }
+
+  CROW_ALWAYS_INLINE uint16_t size() const {
+    return (uint16_t)(head - tail);
+  }
+
+  CROW_ALWAYS_INLINE bool empty() const {
+    return head == tail;
+  }
+
+  static constexpr uint16_t capacity() {
+    return N;
+  }
+
+ private:
+  T items[N];
+  volatile uint16_t head = 0;
+  volatile uint16_t tail = 0;
+};
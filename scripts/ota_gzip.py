@@ -0,0 +1,20 @@
+# PlatformIO post script for the OTA environment: gzip the firmware image
+# after each build and upload the compressed image with espota. The ESP8266
+# bootloader (core 2.7 or later) unpacks gzipped images, and the smaller
+# image takes less time to transfer.
+import gzip
+import shutil
+
+Import("env")
+
+
+def gzip_firmware(source, target, env):
+    firmware = str(target[0])
+    with open(firmware, "rb") as image, gzip.open(firmware + ".gz", "wb", compresslevel=9) as compressed:
+        shutil.copyfileobj(image, compressed)
+    print("OTA image: %s.gz" % firmware)
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.bin", gzip_firmware)
+if env.GetProjectOption("upload_protocol") == "espota":
+    env.Replace(UPLOADCMD=env["UPLOADCMD"].replace("$SOURCE", "${SOURCE}.gz"))
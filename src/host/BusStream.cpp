@@ -0,0 +1,60 @@
+#include "BusStream.h"
+
+#include <sstream>
+
+void appendFrameBits(BitStream& bits, const CrowFrame& frame, unsigned int idleBits) {
+  int ones = 0;
+  for (uint8_t i = 0; i < frame.length; i++) {
+    bool flag = (i == 0 || i == frame.length - 1);
+    for (int bit = 7; bit >= 0; bit--) {
+      uint8_t value = (frame.bytes[i] >> bit) & 1;
+      bits.push_back(value);
+      if (flag) {
+        continue;
+      }
+      if (value) {
+        if (++ones == 5) {
+          bits.push_back(0);
+          ones = 0;
+        }
+      } else {
+        ones = 0;
+      }
+    }
+    if (flag) {
+      ones = 0;
+    }
+  }
+  bits.insert(bits.end(), idleBits, 1);
+}
+
+static bool parseBitString(const std::string& token, CrowFrame& frame) {
+  if (token.size() < 16 || token.size() % 8 != 0 || token.size() > 8u * crowMaxFrameBytes ||
+      token.find_first_not_of("01") != std::string::npos) {
+    return false;
+  }
+  frame.length = token.size() / 8;
+  for (uint8_t i = 0; i < frame.length; i++) {
+    frame.bytes[i] = 0;
+    for (int bit = 0; bit < 8; bit++) {
+      frame.bytes[i] = (frame.bytes[i] << 1) | (token[8 * i + bit] == '1');
+    }
+  }
+  return true;
+}
+
+int appendRecordedLine(BitStream& bits, const std::string& line) {
+  std::istringstream tokens(line);
+  std::string token;
+  int found = 0;
+  while (tokens >> token) {
+    CrowFrame frame;
+    bool parsed = parseBitString(token, frame) ||
+                  (token.size() >= 6 && token.size() % 2 == 0 && crowFrameFromHex(token.c_str(), frame));
+    if (parsed && frame.bytes[0] == 0x7E && frame.bytes[frame.length - 1] == 0x7E) {
+      appendFrameBits(bits, frame);
+      found++;
+    }
+  }
+  return found;
+}
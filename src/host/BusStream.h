@@ -0,0 +1,21 @@
+// Host-side helpers that turn recorded frames back into the raw bit stream
+// the ESP8266 samples on the data line, so they can be replayed through the
+// same deframer and decoder as on the device.
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "CrowDeframer.h"
+
+typedef std::vector<uint8_t> BitStream;
+
+// Append the frame as sent by the panel: opening flag, zero-bit stuffed data,
+// closing flag, followed by idleBits 1s of idle line.
+void appendFrameBits(BitStream& bits, const CrowFrame& frame, unsigned int idleBits = 16);
+
+// Append a line of recorded data. Accepts the hex dumps published on the debug
+// topic (e.g. "7e...7e") and the already destuffed 0/1 strings older firmware
+// printed on the serial port. Anything else on the line is ignored. Returns
+// the number of frames found.
+int appendRecordedLine(BitStream& bits, const std::string& line);
@@ -0,0 +1,782 @@
+// Host-side tool for the Crow bus protocol core ([env:native]).
+//
+//   crowtool replay <file|-> [file2]
+//                              decode recorded hex dumps / bit strings and
+//                              print what the firmware would publish; with
+//                              file2, feed it to a second bus ("Alarm2") at
+//                              the same time, as a two-panel board would
+//   crowtool dump <file|->     print a flight recorder dump (the binary
+//                              messages published on Alarm/recorder)
+//   crowtool capture <host:port|file|->
+//                              receive raw capture batches (from the ESP's
+//                              capture TCP port or a file/pipe of Alarm/capture
+//                              messages) and write a capture file that replay
+//                              accepts to stdout
+//   crowtool rules <rules file> <file|->
+//                              run rules (as published on Alarm/rules) on a
+//                              recording and print what they would do
+//   crowtool bench [file]      deframer/decoder/encoder microbenchmarks, using
+//                              the recorded frames in file or built-in samples
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#include "BusStream.h"
+#include "CrowBusReceiver.h"
+#include "CrowCapture.h"
+#include "CrowCommand.h"
+#include "CrowDecoder.h"
+#include "CrowDeframer.h"
+#include "CrowFrameCache.h"
+#include "CrowFrameRegistry.h"
+#include "CrowEventPayload.h"
+#include "CrowKeypad.h"
+#include "CrowRecorder.h"
+#include "CrowRules.h"
+
+// Frames as published on Alarm/debug_data
+static const char* const sampleFrames[] = {
+  "7e0200a0000000017e",  // status: disarmed
+  "7e020050000080017e",  // status: arming total
+  "7e020020000080017e",  // status: armed total
+  "7e020080000000007e",  // zones 1 to 8, zone 1 active
+  "7e0280c0000000007e",  // zones 9 to 16, zones 9 and 10 active
+  "7e020004400000007e",  // zone 6 active, zone 2 triggered
+};
+
+static bool loadRecording(const char* path, BitStream& bits) {
+  std::ifstream file;
+  std::istream* in = &std::cin;
+  if (strcmp(path, "-") != 0) {
+    file.open(path);
+    if (!file) {
+      fprintf(stderr, "cannot open %s\n", path);
+      return false;
+    }
+    in = &file;
+  }
+  std::string line;
+  while (std::getline(*in, line)) {
+    appendRecordedLine(bits, line);
+  }
+  return true;
+}
+
+static void loadSamples(BitStream& bits) {
+  for (const char* hex : sampleFrames) {
+    appendRecordedLine(bits, hex);
+  }
+}
+
+struct FrameEvents {
+  uint8_t& status;
+  const char* prefix;
+};
+
+static void printPanelEvents(FrameEvents& events, const CrowFrame& frame) {
+  CrowDecoded decoded;
+  if (!crowDecodeFrame(frame, events.status, decoded)) {
+    return;
+  }
+  if (decoded.isStatus) {
+    events.status = decoded.status;
+    printf("  %s/status %s\n", events.prefix, crowStatusName(events.status));
+    return;
+  }
+  for (int zone = 0; zone < 16; zone++) {
+    if (decoded.activeZones & (1u << zone)) {
+      printf("  %s/active_zones %d activo\n", events.prefix, zone + 1);
+    }
+  }
+  for (int zone = 0; zone < 16; zone++) {
+    if (decoded.triggeredZones & (1u << zone)) {
+      printf("  %s/active_zones %d triggered\n", events.prefix, zone + 1);
+    }
+  }
+}
+
+static void printKeypress(FrameEvents&, const CrowFrame& frame) {
+  printf("  keypress %u\n", CrowKeypressFrame(frame).key());
+}
+
+// The frame types the firmware tells apart, see printBuffer() in main.cpp
+static CrowFrameRegistry<FrameEvents> makeFrameTypes() {
+  CrowFrameRegistry<FrameEvents> types;
+  types.add(crowPanelHeader, crowStatusFrameLength, printPanelEvents);
+  types.add(crowKeypadHeader, crowKeypressPacketLength, printKeypress);
+  types.setFallback(crowStatusFrameLength, printPanelEvents);
+  return types;
+}
+static const CrowFrameRegistry<FrameEvents> frameTypes = makeFrameTypes();
+
+static void printFrameEvents(const CrowFrame& frame, uint8_t& status, const char* prefix = "Alarm") {
+  char hex[2 * crowMaxFrameBytes + 1];
+  crowFrameToHex(frame, hex);
+  printf("frame %s\n", hex);
+
+  FrameEvents events = {status, prefix};
+  if (!frameTypes.dispatch(events, frame) && frame.length > 2) {
+    printf("  unknown frame type %02x\n", frame.bytes[1]);
+  }
+}
+
+static void printDeframerStats(const CrowDeframer& deframer) {
+  printf("frames ok=%u misaligned=%u overlong=%u aborted=%u dropped=%u\n",
+         (unsigned)deframer.framesOk, (unsigned)deframer.framesMisaligned,
+         (unsigned)deframer.framesOverlong, (unsigned)deframer.framesAborted,
+         (unsigned)deframer.framesDropped);
+}
+
+// Simulated lines for the bus receivers: the clock reads low, as it does
+// when the edge handler runs, and the data line has the level of the bit
+// being replayed. Nothing is transmitted, so driving the line does nothing.
+struct ReplayClockLine {
+  static bool read() { return false; }
+};
+
+template <int Bus>
+struct ReplayDataLine {
+  static bool read() { return level; }
+  static void write(bool) {}
+  static void output() {}
+  static void input() {}
+  static uint8_t level;
+};
+template <int Bus>
+uint8_t ReplayDataLine<Bus>::level = 1;
+
+// One bus as the firmware runs it: the receiver the clock ISR feeds, and the
+// deframer and decoder loop() drains its ring into
+struct ReplayBus {
+  ReplayBus(const char* prefix, CrowBusPort& port) : prefix(prefix), port(port) {}
+
+  const char* prefix;
+  CrowBusPort& port;
+  BitStream bits;
+  CrowDeframer deframer;
+  uint8_t status = crowDisarmed;
+};
+
+// Clock the next bit of the recording into the bus receiver
+template <int Bus, typename Receiver>
+static void clockBit(Receiver& receiver, const ReplayBus& bus, size_t index) {
+  if (index < bus.bits.size()) {
+    ReplayDataLine<Bus>::level = bus.bits[index];
+    receiver.onClockEdge(index);
+  }
+}
+
+static void drainBus(ReplayBus& bus, bool label) {
+  uint8_t captured;
+  while (bus.port.rxRing.pop(captured)) {
+    for (int bit = 7; bit >= 0; bit--) {
+      bus.deframer.pushBit((captured >> bit) & 1);
+    }
+    while (const CrowFrame* frame = bus.deframer.peekFrame()) {
+      if (label) {
+        printf("%s ", bus.prefix);
+      }
+      printFrameEvents(*frame, bus.status, bus.prefix);
+      bus.deframer.popFrame();
+    }
+  }
+}
+
+static int replay(const char* path, const char* secondPath) {
+  CrowBusReceiver<ReplayClockLine, ReplayDataLine<0>> receiver;
+  CrowBusReceiver<ReplayClockLine, ReplayDataLine<1>> receiver2;
+  ReplayBus buses[] = {{"Alarm", receiver}, {"Alarm2", receiver2}};
+  size_t busCount = secondPath != nullptr ? 2 : 1;
+  if (!loadRecording(path, buses[0].bits) || (busCount == 2 && !loadRecording(secondPath, buses[1].bits))) {
+    return 1;
+  }
+  // Both buses are clocked together, bit by bit, and drained after every
+  // byte like loop() does between interrupts
+  size_t length = std::max(buses[0].bits.size(), buses[1].bits.size());
+  for (size_t i = 0; i < length + 8; i++) {
+    clockBit<0>(receiver, buses[0], i);
+    clockBit<1>(receiver2, buses[1], i);
+    if ((i & 7) == 7) {
+      for (size_t bus = 0; bus < busCount; bus++) {
+        drainBus(buses[bus], busCount > 1);
+      }
+    }
+  }
+  for (size_t bus = 0; bus < busCount; bus++) {
+    if (busCount > 1) {
+      printf("%s ", buses[bus].prefix);
+    }
+    printDeframerStats(buses[bus].deframer);
+  }
+  return 0;
+}
+
+static const char* outcomeName(uint8_t outcome) {
+  switch (outcome) {
+    case crowCommandOk:
+      return "ok";
+    case crowCommandRetry:
+      return "retry";
+    case crowCommandFailed:
+      return "failed";
+    case crowCommandCancelled:
+      return "cancelled";
+    default:
+      return "?";
+  }
+}
+
+static void printRecord(const CrowRecord& record, uint8_t& status) {
+  printf("%10.3fs ", record.timeMs / 1000.0);
+  switch (record.kind) {
+    case crowRecordFrame: {
+      CrowFrame frame;
+      if (crowRecordToFrame(record, frame)) {
+        printFrameEvents(frame, status);
+      } else {
+        printf("frame of %u bytes (truncated)\n", record.length + 2u);
+      }
+      break;
+    }
+    case crowRecordStatus: {
+      const char* from = crowStatusName(record.data[0]);
+      const char* to = crowStatusName(record.data[1]);
+      printf("status %s -> %s\n", from ? from : "?", to ? to : "?");
+      status = record.data[1];
+      break;
+    }
+    case crowRecordCommand:
+      printf("command %.*s %s, attempt %u\n", record.length - 2, (const char*)record.data + 2,
+             outcomeName(record.data[0]), record.data[1]);
+      break;
+    case crowRecordBoot:
+      printf("boot, reset reason %u\n", record.data[0]);
+      status = crowDisarmed;
+      break;
+    default:
+      printf("unknown record kind %u\n", record.kind);
+      break;
+  }
+}
+
+static int dump(const char* path) {
+  std::ifstream file;
+  std::istream* in = &std::cin;
+  if (strcmp(path, "-") != 0) {
+    file.open(path, std::ios::binary);
+    if (!file) {
+      fprintf(stderr, "cannot open %s\n", path);
+      return 1;
+    }
+    in = &file;
+  }
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(*in)), std::istreambuf_iterator<char>());
+
+  // Chunks may be separated by whatever the MQTT client added (newlines)
+  uint8_t status = crowDisarmed;
+  uint32_t records = 0;
+  size_t offset = 0;
+  while (offset < data.size()) {
+    CrowRecorderChunkHeader header;
+    const CrowRecord* chunkRecords;
+    size_t size = crowReadRecorderChunk(data.data() + offset, data.size() - offset, header, chunkRecords);
+    if (size == 0) {
+      offset++;
+      continue;
+    }
+    if (header.index == 0) {
+      printf("dump at %.3fs, %u records\n", header.nowMs / 1000.0, header.total);
+    }
+    for (uint8_t i = 0; i < header.count; i++) {
+      CrowRecord record;
+      memcpy(&record, &chunkRecords[i], sizeof(record));
+      printRecord(record, status);
+      records++;
+    }
+    offset += size;
+  }
+  if (records == 0) {
+    fprintf(stderr, "no recorder chunks found\n");
+    return 1;
+  }
+  return 0;
+}
+
+static int connectTcp(const char* target) {
+  std::string host(target);
+  size_t colon = host.rfind(':');
+  std::string port = host.substr(colon + 1);
+  host.resize(colon);
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+    fprintf(stderr, "cannot resolve %s\n", target);
+    return -1;
+  }
+  int fd = -1;
+  for (addrinfo* address = addresses; address != nullptr && fd < 0; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    fprintf(stderr, "cannot connect to %s\n", target);
+  }
+  return fd;
+}
+
+// Print one batch as replayable lines: "<seconds> <frame hex>"
+static void printCaptureBatch(const uint8_t* data, const CrowCaptureHeader& header, int& expectedSequence,
+                              uint32_t& lostFrames) {
+  if (expectedSequence >= 0 && header.sequence != (uint16_t)expectedSequence) {
+    printf("# batches %d to %u missing\n", expectedSequence, header.sequence - 1u);
+  }
+  expectedSequence = (uint16_t)(header.sequence + 1);
+  if (header.lostFrames != lostFrames) {
+    printf("# %u frames lost on the device, rx overflows %u\n", (unsigned)(header.lostFrames - lostFrames),
+           (unsigned)header.rxOverflows);
+    lostFrames = header.lostFrames;
+  }
+  const uint8_t* p = data + sizeof(header);
+  const uint8_t* end = p + header.length;
+  for (uint16_t i = 0; i < header.count && p != nullptr; i++) {
+    uint32_t cycles;
+    CrowFrame frame;
+    p = crowReadCaptureRecord(p, end, cycles, frame);
+    if (p == nullptr) {
+      printf("# malformed batch %u\n", header.sequence);
+      break;
+    }
+    // Batches are much shorter than the 32-bit cycle counter wraps
+    double us = header.startMs * 1000.0 + (double)(uint32_t)(cycles - header.startCycles) / header.cpuMHz;
+    char hex[2 * crowMaxFrameBytes + 1];
+    crowFrameToHex(frame, hex);
+    printf("%.6f %s\n", us / 1e6, hex);
+  }
+  fflush(stdout);
+}
+
+static int capture(const char* source) {
+  int fd;
+  if (strcmp(source, "-") == 0) {
+    fd = 0;
+  } else if (strchr(source, ':') != nullptr) {
+    fd = connectTcp(source);
+  } else {
+    fd = open(source, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "cannot open %s\n", source);
+    }
+  }
+  if (fd < 0) {
+    return 1;
+  }
+  // Batches come back to back on TCP, possibly with separators from the MQTT
+  // client in between otherwise
+  std::vector<uint8_t> pending;
+  uint8_t chunk[4096];
+  int expectedSequence = -1;
+  uint32_t lostFrames = 0;
+  ssize_t got;
+  while ((got = read(fd, chunk, sizeof(chunk))) > 0) {
+    pending.insert(pending.end(), chunk, chunk + got);
+    size_t offset = 0;
+    while (pending.size() - offset >= sizeof(CrowCaptureHeader)) {
+      CrowCaptureHeader header;
+      size_t size = crowReadCaptureHeader(pending.data() + offset, pending.size() - offset, header);
+      if (size == 0) {
+        offset++;
+        continue;
+      }
+      if (size > pending.size() - offset) {
+        break;  // rest of the batch still to come
+      }
+      printCaptureBatch(pending.data() + offset, header, expectedSequence, lostFrames);
+      offset += size;
+    }
+    pending.erase(pending.begin(), pending.begin() + offset);
+  }
+  if (fd != 0) {
+    close(fd);
+  }
+  return 0;
+}
+
+static const char* const ruleRelayNames[] = {"parcialpin", "totalpin", "alarmepin"};
+// Recordings have no timestamps: the zone hold times of the rules run on the
+// bits, at the panel's usual bit time
+const uint64_t recordingBitUs = 250;
+
+typedef std::chrono::steady_clock benchClock;
+
+static uint32_t clockNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock::now().time_since_epoch()).count();
+}
+
+static void printRuleAction(CrowRuleEngine&, uint8_t index, const CrowRule& rule) {
+  printf("  rule %u:", index + 1);
+  if (rule.action == crowRuleRelay) {
+    printf(" %s %ux%u ms\n", ruleRelayNames[rule.relay], rule.pulse.count, rule.pulse.widthMs);
+    return;
+  }
+  printf(" keys");
+  for (uint8_t i = 0; i < rule.keyCount; i++) {
+    printf(" %u", rule.keys[i]);
+  }
+  printf("\n");
+}
+
+static int rules(const char* rulesPath, const char* path) {
+  std::ifstream rulesFile(rulesPath, std::ios::binary);
+  if (!rulesFile) {
+    fprintf(stderr, "cannot open %s\n", rulesPath);
+    return 1;
+  }
+  std::string text((std::istreambuf_iterator<char>(rulesFile)), std::istreambuf_iterator<char>());
+  CrowRuleEngine engine(clockNs);
+  uint16_t errorLine;
+  if (text.size() > crowRulesTextBytes) {
+    fprintf(stderr, "rules longer than %zu bytes\n", crowRulesTextBytes);
+    return 1;
+  }
+  if (!engine.load(text.data(), text.size(), ruleRelayNames, 3, errorLine)) {
+    fprintf(stderr, "%s:%u: invalid rule\n", rulesPath, errorLine);
+    return 1;
+  }
+  engine.onAction = printRuleAction;
+
+  BitStream bits;
+  if (!loadRecording(path, bits)) {
+    return 1;
+  }
+  CrowDeframer deframer;
+  uint8_t status = crowDisarmed;
+  for (size_t i = 0; i < bits.size(); i++) {
+    deframer.pushBit(bits[i]);
+    while (const CrowFrame* frame = deframer.peekFrame()) {
+      // Same order as the firmware: decode, then the rules. The decode
+      // depends on the previous status, so it is taken before
+      // printFrameEvents() moves it on.
+      CrowDecoded decoded;
+      bool known = crowDecodeFrame(*frame, status, decoded);
+      printFrameEvents(*frame, status);
+      if (known) {
+        if (decoded.isStatus) {
+          engine.onStatus(decoded.status);
+        } else {
+          uint32_t nowMs = (uint32_t)(i * recordingBitUs / 1000);
+          engine.onZones(decoded.zoneMask, decoded.activeZones, decoded.triggeredZones, nowMs);
+        }
+      }
+      deframer.popFrame();
+    }
+  }
+  for (uint8_t i = 0; i < engine.size(); i++) {
+    const CrowRuleStats& stats = engine.ruleStats(i);
+    printf("rule %u: %u evaluations, %u fired, %u ns average, %u ns max\n", i + 1, (unsigned)stats.evaluations,
+           (unsigned)stats.fired, (unsigned)stats.averageCycles(), (unsigned)stats.maxCycles);
+  }
+  return 0;
+}
+
+// The benchmark recorder never snapshots
+class NoFlash : public CrowFlashRegion {
+ public:
+  uint16_t sectorCount() const override { return 0; }
+  bool read(uint32_t, uint32_t*, uint32_t) override { return false; }
+  bool write(uint32_t, const uint32_t*, uint32_t) override { return false; }
+  bool eraseSector(uint16_t) override { return false; }
+};
+
+static double elapsedNs(benchClock::time_point start) {
+  return std::chrono::duration<double, std::nano>(benchClock::now() - start).count();
+}
+
+// Size of a QoS 0 MQTT PUBLISH packet: fixed header, remaining length, topic
+// length, topic and payload
+static size_t mqttPublishBytes(const char* topic, size_t payloadLength) {
+  size_t remaining = 2 + strlen(topic) + payloadLength;
+  return 1 + (remaining < 128 ? 1 : 2) + remaining;
+}
+
+// Status and zone events as the firmware publishes them, as text (one
+// message per zone) or as one binary event payload per frame. Returns the
+// bytes put on the wire.
+static size_t encodeEvents(const std::vector<CrowFrame>& frames, bool binary, volatile uint16_t& sink) {
+  size_t bytes = 0;
+  uint8_t status = crowDisarmed;
+  uint8_t sequence = 0;
+  for (const CrowFrame& frame : frames) {
+    CrowDecoded decoded;
+    if (!crowDecodeFrame(frame, status, decoded)) {
+      continue;
+    }
+    if (decoded.isStatus) {
+      status = decoded.status;
+    }
+    const char* topic = decoded.isStatus ? "Alarm/status" : "Alarm/active_zones";
+    if (binary) {
+      CrowEventPayload event = {status, decoded.activeZones, decoded.triggeredZones,
+                                (uint8_t)(decoded.isStatus ? crowEventFlagStatus : crowEventFlagAnnounce), sequence++,
+                                0};
+      uint8_t payload[crowEventPayloadBytes];
+      size_t length = crowEncodeEventPayload(event, payload);
+      sink = sink + payload[2];
+      bytes += mqttPublishBytes(topic, length);
+    } else if (decoded.isStatus) {
+      const char* name = crowStatusName(status);
+      bytes += mqttPublishBytes(topic, strlen(name));
+    } else {
+      for (int zone = 0; zone < 16; zone++) {
+        uint16_t bit = 1u << zone;
+        if ((decoded.activeZones | decoded.triggeredZones) & bit) {
+          char message[20];
+          int length = snprintf(message, sizeof(message), "%d %s", zone + 1,
+                                decoded.triggeredZones & bit ? "triggered" : "activo");
+          sink = sink + message[0];
+          bytes += mqttPublishBytes(topic, length);
+        }
+      }
+    }
+  }
+  return bytes;
+}
+
+static int bench(const char* path) {
+  BitStream recording;
+  if (path != nullptr) {
+    if (!loadRecording(path, recording)) {
+      return 1;
+    }
+  } else {
+    loadSamples(recording);
+  }
+  if (recording.empty()) {
+    fprintf(stderr, "no frames to benchmark\n");
+    return 1;
+  }
+
+  // Repeat the recording until there is enough traffic to time reliably
+  BitStream bits;
+  while (bits.size() < 8000000) {
+    bits.insert(bits.end(), recording.begin(), recording.end());
+  }
+
+  CrowDeframer deframer;
+  uint8_t status = crowDisarmed;
+  uint32_t decodedFrames = 0;
+  volatile uint16_t sink = 0;
+  benchClock::time_point start = benchClock::now();
+  for (uint8_t bit : bits) {
+    deframer.pushBit(bit);
+    while (const CrowFrame* frame = deframer.peekFrame()) {
+      CrowDecoded decoded;
+      if (crowDecodeFrame(*frame, status, decoded)) {
+        status = decoded.status;
+        sink = sink + decoded.activeZones;
+        decodedFrames++;
+      }
+      deframer.popFrame();
+    }
+  }
+  double ns = elapsedNs(start);
+  printf("deframe+decode: %zu bits, %u frames (%u decoded) in %.1f ms\n", bits.size(),
+         (unsigned)deframer.framesOk, (unsigned)decodedFrames, ns / 1e6);
+  printf("  %.2f Mbit/s, %.1f ns/frame\n", bits.size() / ns * 1e3,
+         deframer.framesOk ? ns / deframer.framesOk : 0.0);
+
+  // Recorder cost per frame, on the same traffic (mostly repeats, as on the bus)
+  NoFlash noFlash;
+  CrowRecorder recorder(noFlash);
+  std::vector<CrowFrame> frames;
+  CrowDeframer collector;
+  for (uint8_t bit : recording) {
+    collector.pushBit(bit);
+    while (const CrowFrame* frame = collector.peekFrame()) {
+      frames.push_back(*frame);
+      collector.popFrame();
+    }
+  }
+  const uint32_t recordRounds = 1000000 / frames.size() + 1;
+  start = benchClock::now();
+  for (uint32_t round = 0; round < recordRounds; round++) {
+    for (const CrowFrame& frame : frames) {
+      recorder.recordFrame(frame, round);
+    }
+  }
+  ns = elapsedNs(start);
+  printf("recorder: %.1f ns/frame (%u recorded, %u repeats skipped)\n", ns / (recordRounds * frames.size()),
+         (unsigned)recorder.recorded, (unsigned)recorder.repeatsSkipped);
+
+  // printBuffer()'s work per frame, every frame in full and through the
+  // frame cache: on a miss the hex dump on the serial port (here /dev/null),
+  // the flight recorder and the dispatch by frame type with the decode; on a
+  // hit only the cache lookup and its result
+  struct FramePath {
+    uint8_t status;
+    CrowFrameCache* cache;
+    volatile uint16_t& sink;
+  };
+  CrowFrameRegistry<FramePath> pathTypes;
+  pathTypes.add(crowPanelHeader, crowStatusFrameLength, [](FramePath& path, const CrowFrame& frame) {
+    CrowDecoded decoded;
+    if (crowDecodeFrame(frame, path.status, decoded)) {
+      if (path.cache != nullptr) {
+        path.cache->store(frame, path.status, decoded);
+      }
+      path.status = decoded.status;
+      path.sink = path.sink + decoded.activeZones;
+    }
+  });
+  FILE* serial = fopen("/dev/null", "w");
+  if (serial == nullptr) {
+    perror("/dev/null");
+    return 1;
+  }
+  const uint32_t cacheRounds = 1000000 / frames.size() + 1;
+  for (bool cached : {false, true}) {
+    CrowFrameCache cache;
+    CrowRecorder pathRecorder(noFlash);
+    FramePath path = {crowDisarmed, cached ? &cache : nullptr, sink};
+    start = benchClock::now();
+    for (uint32_t round = 0; round < cacheRounds; round++) {
+      for (const CrowFrame& frame : frames) {
+        CrowDecoded decoded;
+        if (cached && cache.lookup(frame, path.status, decoded)) {
+          sink = sink + decoded.activeZones;
+          continue;
+        }
+        char hex[2 * crowMaxFrameBytes + 1];
+        crowFrameToHex(frame, hex);
+        fputs(hex, serial);
+        fputc('\n', serial);
+        pathRecorder.recordFrame(frame, round);
+        pathTypes.dispatch(path, frame);
+      }
+    }
+    ns = elapsedNs(start);
+    if (cached) {
+      printf("  through the cache on this recording: %.1f ns/frame (%u hits, %u misses)\n",
+             ns / (cacheRounds * frames.size()), (unsigned)cache.hits, (unsigned)cache.misses);
+    } else {
+      printf("frame path: %.1f ns/frame in full\n", ns / (cacheRounds * frames.size()));
+    }
+  }
+  fclose(serial);
+  // A hit alone, as on the panel's endless repeats: each frame is handled
+  // until the cache holds it, then looked up again and again
+  CrowFrameCache hitCache;
+  FramePath hitPath = {crowDisarmed, &hitCache, sink};
+  double hitNs = 0;
+  uint32_t hits = 0;
+  for (const CrowFrame& frame : frames) {
+    CrowDecoded decoded;
+    for (int i = 0; i < 4 && !hitCache.lookup(frame, hitPath.status, decoded); i++) {
+      pathTypes.dispatch(hitPath, frame);
+    }
+    uint32_t hitsBefore = hitCache.hits;
+    start = benchClock::now();
+    for (uint32_t round = 0; round < cacheRounds; round++) {
+      if (hitCache.lookup(frame, hitPath.status, decoded)) {
+        sink = sink + decoded.activeZones;
+      }
+    }
+    hitNs += elapsedNs(start);
+    hits += hitCache.hits - hitsBefore;
+  }
+  printf("  on a cache hit: %.1f ns/frame (%u of %u lookups hit)\n", hitNs / (cacheRounds * frames.size()),
+         (unsigned)hits, (unsigned)(cacheRounds * frames.size()));
+
+  // Decode through the frame type registry, as printBuffer() does on a miss
+  struct DispatchSink {
+    uint8_t status;
+    volatile uint16_t& sink;
+  };
+  CrowFrameRegistry<DispatchSink> types;
+  types.add(crowPanelHeader, crowStatusFrameLength, [](DispatchSink& bench, const CrowFrame& frame) {
+    CrowDecoded decoded;
+    if (crowDecodeFrame(frame, bench.status, decoded)) {
+      bench.status = decoded.status;
+      bench.sink = bench.sink + decoded.activeZones;
+    }
+  });
+  DispatchSink dispatchSink = {crowDisarmed, sink};
+  uint32_t unknown = 0;
+  start = benchClock::now();
+  for (uint32_t round = 0; round < cacheRounds; round++) {
+    for (const CrowFrame& frame : frames) {
+      unknown += !types.dispatch(dispatchSink, frame);
+    }
+  }
+  ns = elapsedNs(start);
+  printf("dispatched decode: %.1f ns/frame (%u of unknown type)\n", ns / (cacheRounds * frames.size()),
+         (unsigned)unknown);
+
+  // Event payloads, text against binary, for every decoded frame
+  const uint32_t eventRounds = 200000 / frames.size() + 1;
+  for (bool binary : {false, true}) {
+    size_t bytes = 0;
+    start = benchClock::now();
+    for (uint32_t round = 0; round < eventRounds; round++) {
+      bytes = encodeEvents(frames, binary, sink);
+    }
+    ns = elapsedNs(start);
+    printf("%s events: %zu bytes on the wire for %zu frames, %.1f ns/frame with the decode\n",
+           binary ? "binary" : "text", bytes, frames.size(), ns / (eventRounds * frames.size()));
+  }
+
+  const uint32_t keypresses = 1000000;
+  uint8_t packet[crowKeypressPacketLength];
+  start = benchClock::now();
+  for (uint32_t i = 0; i < keypresses; i++) {
+    crowEncodeKeypress(i & 0x3F, packet);
+    sink = sink + packet[3];
+  }
+  ns = elapsedNs(start);
+  printf("keypress encode: %.1f ns/packet\n", ns / keypresses);
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: crowtool replay <file|-> [file2]\n"
+                  "       crowtool dump <file|->\n"
+                  "       crowtool capture <host:port|file|->\n"
+                  "       crowtool rules <rules file> <file|->\n"
+                  "       crowtool bench [file]\n");
+}
+
+int main(int argc, char** argv) {
+  if (argc >= 3 && strcmp(argv[1], "replay") == 0) {
+    return replay(argv[2], argc >= 4 ? argv[3] : nullptr);
+  }
+  if (argc >= 3 && strcmp(argv[1], "dump") == 0) {
+    return dump(argv[2]);
+  }
+  if (argc >= 3 && strcmp(argv[1], "capture") == 0) {
+    return capture(argv[2]);
+  }
+  if (argc >= 4 && strcmp(argv[1], "rules") == 0) {
+    return rules(argv[2], argv[3]);
+  }
+  if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+    return bench(argc >= 3 ? argv[2] : nullptr);
+  }
+  usage();
+  return 2;
+}
@@ -0,0 +1,2 @@
+// The firmware itself, built against the simulated board in src/host/sim
+#include "../../main.cpp"
@@ -0,0 +1,611 @@
+// End-to-end latency harness ([env:latency]): runs the firmware in
+// src/main.cpp on the simulated board (src/host/sim) against a simulated Crow
+// panel and reports, per scenario, how long it takes from something happening
+// on the bus to the MQTT message leaving the box, and from a control message
+// to the last keypress bit on the wire.
+//
+//   latency [zone] [arm] [trigger] [rules] [storm] [--runs n] [--bit-us n]
+//           [--cpu-scale x] [--serial]
+//
+// Time is simulated. The bus is clocked at --bit-us per bit. Each loop() pass
+// costs its run time on the host times --cpu-scale (the ESP8266 being that
+// much slower), and at least 100 us. The latencies are those the firmware's
+// own logic and scheduling add (coalescing windows, task order, outbox),
+// plus that CPU model, not Wi-Fi or broker delays.
+//
+// Each scenario runs in its own process, from a fresh boot.
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <Arduino.h>
+#include "BusStream.h"
+#include "CrowDecoder.h"
+#include "CrowKeypad.h"
+#include "SimBoard.h"
+
+void setup();
+void loop();
+
+// Bus pins, as in src/main.cpp
+const uint8_t busClockPin = D6;
+const uint8_t busDataPin = D7;
+
+const uint64_t msNs = 1000000;
+
+struct Options {
+  uint32_t runs = 50;
+  uint32_t bitUs = 250;
+  double cpuScale = 30;
+  uint64_t minPassNs = 100000;
+  uint64_t exitDelayNs = 1000 * msNs;
+  uint64_t stormNs = 20000 * msNs;
+};
+static Options options;
+
+// The panel end of the bus: clocks it continuously, sends its status and zone
+// frames in turn with idle bits in between, and reacts to the keypresses the
+// firmware sends (arming and disarming) like a Crow Runner would.
+class SimPanel : public sim::Device {
+ public:
+  explicit SimPanel(uint64_t bitNs) : bitNs(bitNs), nextNs(bitNs) {
+    sim::setInput(busClockPin, true);
+    sim::setInput(busDataPin, true);
+  }
+
+  uint64_t nextEventNs() override { return nextNs; }
+
+  void runEvent() override {
+    if (armAtNs <= nextNs) {
+      setStatus(armTo);
+      armAtNs = UINT64_MAX;
+    }
+    if (clockHigh) {
+      // Falling edge: the bit is on the line and the firmware samples it
+      sim::setInput(busDataPin, nextBit());
+      sim::setInput(busClockPin, false);
+      sim::interrupt(busClockPin);
+      if (bitIndex == frameBits.size() && frameOpen) {
+        frameSent();
+      }
+      readKeypad();
+    } else {
+      sim::setInput(busClockPin, true);
+    }
+    clockHigh = !clockHigh;
+    nextNs += bitNs / 2;
+  }
+
+  void setStatus(uint8_t value) {
+    if (value != status) {
+      status = value;
+      versions[crowFrameStatus]++;
+    }
+  }
+
+  void setZones(uint16_t active, uint16_t triggered) {
+    if ((active ^ activeZones) & 0x00FF || (triggered ^ triggeredZones) & 0x00FF) {
+      versions[crowFrameZonesLow]++;
+    }
+    if ((active ^ activeZones) & 0xFF00 || (triggered ^ triggeredZones) & 0xFF00) {
+      versions[crowFrameZonesHigh]++;
+    }
+    activeZones = active;
+    triggeredZones = triggered;
+  }
+
+  // The panel sends the zone frames again with the same content, as it does
+  // when it reports a zone after a silence
+  void repeatZones() {
+    versions[crowFrameZonesLow]++;
+    versions[crowFrameZonesHigh]++;
+  }
+
+  // When the first frame of that type showing the last change was complete
+  // on the bus, 0 if it has not been sent yet
+  uint64_t changeSentNs(uint8_t type) const { return sentVersions[type] == versions[type] ? sentNs[type] : 0; }
+
+  bool storm = false;       // new random zones in every zone frame
+  bool zoneFrames = true;   // false: only status frames, zones are not reported
+  std::vector<std::pair<uint64_t, uint16_t>> stormChanges;  // frame end, active zones
+  uint32_t framesSent = 0;
+  uint32_t keypresses = 0;
+  uint64_t lastKeyNs = 0;   // when the last keypress packet was complete on the line
+
+ private:
+  uint8_t nextBit() {
+    if (sim::outputEnabled(busDataPin)) {
+      idleBits = 0;  // a keypad has the bus
+      return 1;
+    }
+    if (bitIndex < frameBits.size()) {
+      return frameBits[bitIndex++];
+    }
+    if (++idleBits < frameIdleBits) {
+      return 1;
+    }
+    startFrame();
+    return frameBits[bitIndex++];
+  }
+
+  void startFrame() {
+    static const uint8_t cycle[] = {crowFrameStatus, crowFrameZonesLow, crowFrameZonesHigh};
+    frameType = cycle[frameCount++ % 3];
+    if (!zoneFrames) {
+      frameType = crowFrameStatus;
+    }
+    if (storm && frameType != crowFrameStatus) {
+      uint16_t half = frameType == crowFrameZonesLow ? 0x00FF : 0xFF00;
+      setZones((activeZones & ~half) | (random() & half), triggeredZones);
+    }
+    CrowFrame frame = {};
+    frame.length = crowStatusFrameLength;
+    uint8_t* bytes = frame.bytes;
+    bytes[0] = bytes[8] = 0x7E;
+    bytes[1] = 0x02;
+    if (frameType == crowFrameStatus) {
+      statusBytes(bytes);
+      bytes[7] |= 0x01;
+    } else {
+      uint8_t offset = frameType == crowFrameZonesHigh ? 8 : 0;
+      bytes[2] = offset ? 0x80 : 0;
+      bytes[3] = msbFirst(activeZones >> offset);
+      bytes[4] = msbFirst(triggeredZones >> offset);
+    }
+    frameVersion = versions[frameType];
+    frameBits.clear();
+    appendFrameBits(frameBits, frame, 0);
+    bitIndex = 0;
+    idleBits = 0;
+    frameOpen = true;
+  }
+
+  void statusBytes(uint8_t* bytes) const {
+    // bytes[3]: statu1 0x80, statu2 0x40, already armed 0x20, statu3 0x10;
+    // bytes[6] 0x80 armed total; bytes[7] 0x80 armed partial
+    switch (status) {
+      case crowArmedTotal:
+        bytes[3] = 0x20;
+        bytes[6] = 0x80;
+        break;
+      case crowArmedPartial:
+        bytes[3] = 0x20;
+        bytes[7] = 0x80;
+        break;
+      case crowArmingTotal:
+        bytes[3] = 0x50;
+        bytes[6] = 0x80;
+        break;
+      case crowArmingPartial:
+        bytes[3] = 0x50;
+        bytes[7] = 0x80;
+        break;
+      case crowTriggered:
+        bytes[3] = 0xF0;
+        bytes[6] = 0x80;
+        break;
+      default:
+        bytes[3] = 0xA0;
+        break;
+    }
+  }
+
+  static uint8_t msbFirst(uint8_t zones) {
+    uint8_t bits = 0;
+    for (int i = 0; i < 8; i++) {
+      if (zones & (1 << i)) {
+        bits |= 0x80 >> i;
+      }
+    }
+    return bits;
+  }
+
+  void frameSent() {
+    frameOpen = false;
+    framesSent++;
+    if (sentVersions[frameType] != frameVersion) {
+      sentVersions[frameType] = frameVersion;
+      sentNs[frameType] = sim::nowNs();
+      if (storm && frameType != crowFrameStatus) {
+        stormChanges.push_back({sim::nowNs(), activeZones});
+      }
+    }
+  }
+
+  // Collect the bits the firmware drives; the packet is complete when it
+  // releases the line
+  void readKeypad() {
+    if (sim::outputEnabled(busDataPin)) {
+      keyBits.push_back(sim::outputLevel(busDataPin));
+      return;
+    }
+    if (keyBits.empty()) {
+      return;
+    }
+    if (keyBits.size() >= 8 * crowKeypressPacketLength) {
+      uint8_t packet[crowKeypressPacketLength] = {};
+      for (size_t i = 0; i < 8 * crowKeypressPacketLength; i++) {
+        packet[i / 8] = packet[i / 8] << 1 | keyBits[i];
+      }
+      uint8_t key = 0;
+      for (int i = 0; i < 8; i++) {
+        key |= ((packet[3] >> i) & 1) << (7 - i);  // sent LSB first
+      }
+      onKeypress(key);
+    }
+    keyBits.clear();
+  }
+
+  void onKeypress(uint8_t key) {
+    keypresses++;
+    lastKeyNs = sim::nowNs();
+    if (key == crowKeyTotal || key == crowKeyParcial) {
+      bool total = key == crowKeyTotal;
+      setStatus(total ? crowArmingTotal : crowArmingPartial);
+      armTo = total ? crowArmedTotal : crowArmedPartial;
+      armAtNs = sim::nowNs() + options.exitDelayNs;
+    } else if (key < 10) {
+      digits++;
+    } else if (key == crowKeyEnter) {
+      if (digits > 0 && status != crowDisarmed) {
+        setStatus(crowDisarmed);
+        setZones(0, 0);
+        armAtNs = UINT64_MAX;
+      }
+      digits = 0;
+    }
+  }
+
+  static const unsigned int frameIdleBits = 16;
+
+  uint64_t bitNs;
+  uint64_t nextNs;
+  bool clockHigh = true;
+
+  uint8_t status = crowDisarmed;
+  uint16_t activeZones = 0;
+  uint16_t triggeredZones = 0;
+  uint32_t versions[crowFrameTypeCount] = {};
+  uint32_t sentVersions[crowFrameTypeCount] = {};
+  uint64_t sentNs[crowFrameTypeCount] = {};
+
+  BitStream frameBits;
+  size_t bitIndex = 0;
+  unsigned int idleBits = 0;
+  bool frameOpen = false;
+  uint8_t frameType = crowFrameStatus;
+  uint32_t frameVersion = 0;
+  uint32_t frameCount = 0;
+
+  std::vector<uint8_t> keyBits;
+  uint8_t digits = 0;
+  uint8_t armTo = crowDisarmed;
+  uint64_t armAtNs = UINT64_MAX;
+};
+
+static SimPanel* panel;
+
+// One loop() pass, then the clock moves on by what it would have taken on the ESP
+static void runPass() {
+  auto start = std::chrono::steady_clock::now();
+  loop();
+  double hostNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  uint64_t passNs = std::max<uint64_t>(options.minPassNs, hostNs * options.cpuScale);
+  sim::advanceTo(sim::nowNs() + passNs);
+}
+
+static void runFor(uint64_t ns) {
+  uint64_t end = sim::nowNs() + ns;
+  while (sim::nowNs() < end) {
+    runPass();
+  }
+}
+
+// Run until the firmware publishes payload (or a payload starting with it)
+// on topic, looking at the messages from index from on. Returns the index of
+// the message, -1 if it did not come within timeoutNs.
+static long waitForPublish(size_t from, const char* topic, const std::string& payload, uint64_t timeoutNs,
+                           bool prefix = false) {
+  uint64_t end = sim::nowNs() + timeoutNs;
+  for (;;) {
+    for (size_t i = from; i < sim::published.size(); i++) {
+      const sim::Message& message = sim::published[i];
+      if (message.topic == topic &&
+          (prefix ? message.payload.compare(0, payload.size(), payload) == 0 : message.payload == payload)) {
+        return i;
+      }
+    }
+    from = sim::published.size();
+    if (sim::nowNs() >= end) {
+      return -1;
+    }
+    runPass();
+  }
+}
+
+struct Latencies {
+  explicit Latencies(const char* name) : name(name) {}
+
+  void add(uint64_t fromNs, long message) {
+    if (message < 0 || fromNs == 0) {
+      missed++;
+      return;
+    }
+    ms.push_back((sim::published[message].timeNs - fromNs) / 1e6);
+  }
+  void addNs(uint64_t ns) { ms.push_back(ns / 1e6); }
+
+  double percentile(double p) const {
+    size_t index = (size_t)std::ceil(p * ms.size());
+    return ms[index > 0 ? index - 1 : 0];
+  }
+
+  void print() {
+    if (ms.empty()) {
+      printf("  %-48s no samples (%zu missed)\n", name, missed);
+      return;
+    }
+    std::sort(ms.begin(), ms.end());
+    printf("  %-48s n=%-4zu p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f ms", name, ms.size(), percentile(0.5),
+           percentile(0.9), percentile(0.99), ms.back());
+    printf(missed ? "  (%zu missed)\n" : "\n", missed);
+  }
+
+  const char* name;
+  std::vector<double> ms;
+  size_t missed = 0;
+};
+
+static uint8_t zoneFrameType(int zone) {
+  return zone < 8 ? crowFrameZonesLow : crowFrameZonesHigh;
+}
+
+// A zone opens and closes again, one zone at a time
+static void scenarioZone() {
+  Latencies announce("bus frame -> Alarm/active_zones \"<n> activo\"");
+  Latencies zones("bus frame -> Alarm/zones");
+  for (uint32_t run = 0; run < options.runs; run++) {
+    int zone = run % 16;
+    size_t from = sim::published.size();
+    panel->setZones(1u << zone, 0);
+    long message = waitForPublish(from, "Alarm/active_zones", std::to_string(zone + 1) + " activo", 5000 * msNs);
+    announce.add(panel->changeSentNs(zoneFrameType(zone)), message);
+    char json[64];
+    snprintf(json, sizeof(json), "{\"active\":[%d],\"triggered\":[]}", zone + 1);
+    zones.add(panel->changeSentNs(zoneFrameType(zone)), waitForPublish(from, "Alarm/zones", json, 1000 * msNs));
+    panel->setZones(0, 0);
+    runFor(4000 * msNs);  // past the zone hold time
+  }
+  announce.print();
+  zones.print();
+}
+
+// Arm from Alarm/control, then disarm
+static void scenarioArm() {
+  Latencies armKeys("Alarm/control total -> last key bit");
+  Latencies arming("bus frame -> Alarm/status \"A armar Total\"");
+  Latencies armed("Alarm/control total -> Alarm/result ok");
+  Latencies disarmKeys("Alarm/control desarmar -> last key bit");
+  Latencies disarmed("bus frame -> Alarm/status \"Desarmado\"");
+  for (uint32_t run = 0; run < options.runs; run++) {
+    size_t from = sim::published.size();
+    uint32_t keys = panel->keypresses;
+    uint64_t sentNs = sim::nowNs();
+    sim::injectMessage("Alarm/control", "total", sentNs);
+    arming.add(panel->changeSentNs(crowFrameStatus),
+               waitForPublish(from, "Alarm/status", crowStatusName(crowArmingTotal), 5000 * msNs));
+    armed.add(sentNs, waitForPublish(from, "Alarm/result", "total ok", options.exitDelayNs + 10000 * msNs, true));
+    if (panel->keypresses > keys) {
+      armKeys.addNs(panel->lastKeyNs - sentNs);
+    }
+
+    from = sim::published.size();
+    keys = panel->keypresses;
+    sentNs = sim::nowNs();
+    sim::injectMessage("Alarm/control", "desarmar-1234", sentNs);
+    disarmed.add(panel->changeSentNs(crowFrameStatus),
+                 waitForPublish(from, "Alarm/status", crowStatusName(crowDisarmed), 5000 * msNs));
+    waitForPublish(from, "Alarm/result", "desarmar ok", 5000 * msNs, true);
+    if (panel->keypresses > keys) {
+      disarmKeys.addNs(panel->lastKeyNs - sentNs);
+    }
+    runFor(1000 * msNs);
+  }
+  armKeys.print();
+  arming.print();
+  armed.print();
+  disarmKeys.print();
+  disarmed.print();
+}
+
+// The alarm goes off while armed: status and triggered zone
+static void scenarioTrigger() {
+  Latencies status("bus frame -> Alarm/status \"Alarme Despoletado\"");
+  Latencies zone("bus frame -> Alarm/active_zones \"<n> triggered\"");
+  for (uint32_t run = 0; run < options.runs; run++) {
+    panel->setStatus(crowArmedTotal);
+    runFor(1500 * msNs);
+    int triggered = run % 16;
+    size_t from = sim::published.size();
+    panel->setStatus(crowTriggered);
+    panel->setZones(0, 1u << triggered);
+    status.add(panel->changeSentNs(crowFrameStatus),
+               waitForPublish(from, "Alarm/status", crowStatusName(crowTriggered), 5000 * msNs));
+    zone.add(panel->changeSentNs(zoneFrameType(triggered)),
+             waitForPublish(from, "Alarm/active_zones", std::to_string(triggered + 1) + " triggered", 5000 * msNs));
+    panel->setStatus(crowDisarmed);
+    panel->setZones(0, 0);
+    runFor(4000 * msNs);
+  }
+  status.print();
+  zone.print();
+}
+
+// A local rule on a zone that opens, then goes unreported past the zone hold
+// time with no frame closing it, and is reported open again: the rule must
+// fire both times
+static void scenarioRules() {
+  Latencies first("bus frame -> rule fired (zone opens)");
+  Latencies again("bus frame -> rule fired (reported again)");
+  size_t from = sim::published.size();
+  sim::injectMessage("Alarm/rules", "activo:3 alarmepin", sim::nowNs());
+  if (waitForPublish(from, "Alarm/log", "Regras: 1 carregadas", 5000 * msNs) < 0) {
+    printf("  rules not loaded\n");
+    fflush(stdout);
+    _exit(1);
+  }
+  for (uint32_t run = 0; run < options.runs; run++) {
+    from = sim::published.size();
+    panel->setZones(1u << 2, 0);
+    first.add(panel->changeSentNs(crowFrameZonesLow),
+              waitForPublish(from, "Alarm/log", "Regra 1 executada", 5000 * msNs, true));
+    panel->zoneFrames = false;
+    runFor(4000 * msNs);  // past the zone hold time
+    from = sim::published.size();
+    panel->zoneFrames = true;
+    panel->repeatZones();
+    again.add(panel->changeSentNs(crowFrameZonesLow),
+              waitForPublish(from, "Alarm/log", "Regra 1 executada", 5000 * msNs, true));
+    panel->setZones(0, 0);
+    runFor(4000 * msNs);
+  }
+  first.print();
+  again.print();
+  if (first.missed > 0 || again.missed > 0) {
+    fflush(stdout);
+    _exit(1);
+  }
+}
+
+// Every zone frame reports different zones
+static void scenarioStorm() {
+  size_t from = sim::published.size();
+  uint32_t frames = panel->framesSent;
+  uint64_t start = sim::nowNs();
+  panel->storm = true;
+  runFor(options.stormNs);
+  panel->storm = false;
+  runFor(1000 * msNs);
+  double seconds = (sim::nowNs() - start) / 1e9;
+
+  // How stale Alarm/zones gets: from each change on the bus to the next
+  // Alarm/zones publish after it
+  Latencies stale("bus frame -> next Alarm/zones");
+  size_t published = 0;
+  size_t zonesMessages = 0;
+  size_t next = from;
+  for (const auto& change : panel->stormChanges) {
+    while (next < sim::published.size() &&
+           (sim::published[next].topic != "Alarm/zones" || sim::published[next].timeNs < change.first)) {
+      next++;
+    }
+    stale.add(change.first, next < sim::published.size() ? (long)next : -1);
+  }
+  for (size_t i = from; i < sim::published.size(); i++) {
+    published++;
+    zonesMessages += sim::published[i].topic == "Alarm/zones";
+  }
+  printf("  %u frames, %zu zone changes on the bus; %zu messages published (%zu on Alarm/zones) in %.1f s\n",
+         (unsigned)(panel->framesSent - frames), panel->stormChanges.size(), published, zonesMessages, seconds);
+  printf("  %.1f frames/s, %.1f zone changes/s, %.1f messages/s\n", (panel->framesSent - frames) / seconds,
+         panel->stormChanges.size() / seconds, published / seconds);
+  stale.print();
+}
+
+struct Scenario {
+  const char* name;
+  void (*run)();
+};
+static const Scenario scenarios[] = {
+  {"zone", scenarioZone},
+  {"arm", scenarioArm},
+  {"trigger", scenarioTrigger},
+  {"rules", scenarioRules},
+  {"storm", scenarioStorm},
+};
+
+static void runScenario(const Scenario& scenario) {
+  auto start = std::chrono::steady_clock::now();
+  panel = new SimPanel(options.bitUs * 1000ull);
+  sim::attach(panel);
+  setup();
+  size_t bootMessages = sim::published.size();
+  runFor(3000 * msNs);
+  printf("%s:\n", scenario.name);
+  if (sim::published.size() > bootMessages) {
+    printf("  boot: first publish %.1f ms after the reset\n", sim::published[bootMessages].timeNs / 1e6);
+  }
+  scenario.run();
+  double wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  printf("  (%.1f s simulated in %.1f s)\n", sim::nowNs() / 1e9, wallMs / 1e3);
+}
+
+static void usage() {
+  fprintf(stderr, "usage: latency [zone] [arm] [trigger] [rules] [storm] [--runs n] [--bit-us n] [--cpu-scale x] "
+                  "[--serial]\n");
+}
+
+int main(int argc, char** argv) {
+  std::vector<const Scenario*> selected;
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (strcmp(arg, "--runs") == 0 && hasValue) {
+      options.runs = atoi(argv[++i]);
+    } else if (strcmp(arg, "--bit-us") == 0 && hasValue) {
+      options.bitUs = atoi(argv[++i]);
+    } else if (strcmp(arg, "--cpu-scale") == 0 && hasValue) {
+      options.cpuScale = atof(argv[++i]);
+    } else if (strcmp(arg, "--serial") == 0) {
+      sim::serialEcho = true;
+    } else {
+      const Scenario* found = nullptr;
+      for (const Scenario& scenario : scenarios) {
+        if (strcmp(arg, scenario.name) == 0) {
+          found = &scenario;
+        }
+      }
+      if (found == nullptr) {
+        usage();
+        return 2;
+      }
+      selected.push_back(found);
+    }
+  }
+  if (selected.empty()) {
+    for (const Scenario& scenario : scenarios) {
+      selected.push_back(&scenario);
+    }
+  }
+  if (options.runs == 0 || options.bitUs < 40) {
+    usage();
+    return 2;
+  }
+  printf("bus %u us/bit, loop() pass = host time x %.0f (at least %.0f us)\n", (unsigned)options.bitUs,
+         options.cpuScale, options.minPassNs / 1e3);
+  // A fresh firmware per scenario: its state is all in globals
+  for (const Scenario* scenario : selected) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      runScenario(*scenario);
+      fflush(stdout);
+      _exit(0);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "%s: failed\n", scenario->name);
+      return 1;
+    }
+  }
+  return 0;
+}
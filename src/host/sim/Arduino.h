@@ -0,0 +1,118 @@
+// Arduino core API on the simulated board, see SimBoard.h
+#pragma once
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SimBoard.h"
+
+#define IRAM_ATTR
+#define ICACHE_RAM_ATTR
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x00
+#define OUTPUT 0x01
+#define INPUT_PULLUP 0x02
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+// NodeMCU pin names
+#define D0 16
+#define D1 5
+#define D2 4
+#define D3 0
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+inline int digitalPinToInterrupt(int pin) { return pin; }
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode);
+void detachInterrupt(uint8_t pin);
+
+// GPIO registers, as used for fast pin access in the clock ISR
+uint32_t simGpioIn();
+#define GPI (simGpioIn())
+struct SimGpioRegister {
+  void (*store)(uint32_t mask);
+  void operator=(uint32_t mask) const { store(mask); }
+};
+extern const SimGpioRegister GPOS, GPOC, GPES, GPEC;
+// Pin control registers, only kept so setup() can configure the driver
+extern uint32_t simGpioControl[16];
+#define GPC(p) (simGpioControl[(p) & 0xF])
+#define GPCD 2
+
+class IPAddress {
+ public:
+  IPAddress() {}
+  IPAddress(uint32_t address) : address(address) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address(a | b << 8 | c << 16 | (uint32_t)d << 24) {}
+  operator uint32_t() const { return address; }
+  uint8_t operator[](int index) const { return address >> (8 * index); }
+
+ private:
+  uint32_t address = 0;
+};
+
+class HardwareSerial {
+ public:
+  void begin(unsigned long) {}
+  size_t print(const char* text);
+  size_t print(long value);
+  size_t print(unsigned long value);
+  size_t print(int value) { return print((long)value); }
+  size_t print(unsigned int value) { return print((unsigned long)value); }
+  size_t print(const IPAddress& ip);
+  template <typename T>
+  size_t println(const T& value) {
+    return print(value) + print("\n");
+  }
+  size_t println() { return print("\n"); }
+  int printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+extern HardwareSerial Serial;
+
+#define REASON_DEFAULT_RST 0
+#define REASON_WDT_RST 1
+#define REASON_EXCEPTION_RST 2
+#define REASON_SOFT_WDT_RST 3
+#define REASON_SOFT_RESTART 4
+#define REASON_DEEP_SLEEP_AWAKE 5
+#define REASON_EXT_SYS_RST 6
+struct rst_info {
+  uint32_t reason;
+};
+
+class EspClass {
+ public:
+  uint32_t getCycleCount() { return sim::nowNs() * sim::cpuMHz / 1000; }
+  uint8_t getCpuFreqMHz() { return sim::cpuMHz; }
+  uint32_t getFreeHeap() { return 40000; }
+  uint32_t getMaxFreeBlockSize() { return 32000; }
+  uint8_t getHeapFragmentation() { return 10; }
+  rst_info* getResetInfoPtr();
+  void wdtEnable(uint32_t) {}
+  void wdtFeed() {}
+  [[noreturn]] void restart();
+};
+extern EspClass ESP;
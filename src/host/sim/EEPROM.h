@@ -0,0 +1,29 @@
+// EEPROM emulation on the simulated board, erased (0xFF) at start
+#pragma once
+
+#include <Arduino.h>
+#include <vector>
+
+class EEPROMClass {
+ public:
+  void begin(size_t size) { data.resize(size, 0xFF); }
+  uint8_t read(int address) { return data.at(address); }
+  void write(int address, uint8_t value) { data.at(address) = value; }
+  bool commit() { return true; }
+  template <typename T>
+  T& get(int address, T& value) {
+    data.at(address + sizeof(T) - 1);  // range check
+    memcpy(&value, &data[address], sizeof(T));
+    return value;
+  }
+  template <typename T>
+  const T& put(int address, const T& value) {
+    data.at(address + sizeof(T) - 1);
+    memcpy(&data[address], &value, sizeof(T));
+    return value;
+  }
+
+ private:
+  std::vector<uint8_t> data;
+};
+extern EEPROMClass EEPROM;
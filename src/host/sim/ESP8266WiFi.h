@@ -0,0 +1,60 @@
+// ESP8266WiFi on the simulated board: the station connects wifiConnectNs
+// after WiFi.begin(), see SimBoard.h. The capture server never gets a client.
+#pragma once
+
+#include <Arduino.h>
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_DISCONNECTED = 6,
+} wl_status_t;
+
+#define WIFI_STA 1
+
+class ESP8266WiFiClass {
+ public:
+  void persistent(bool) {}
+  bool mode(int) { return true; }
+  void setAutoReconnect(bool) {}
+  bool config(IPAddress, IPAddress, IPAddress, IPAddress = IPAddress()) { return true; }
+  wl_status_t begin(const char* ssid, const char* password, int32_t channel = 0, const uint8_t* bssid = nullptr,
+                    bool connect = true);
+  bool disconnect(bool = false) {
+    connectAtNs = UINT64_MAX;
+    return true;
+  }
+  wl_status_t status();
+  IPAddress localIP() { return IPAddress(192, 168, 1, 50); }
+  IPAddress gatewayIP() { return IPAddress(192, 168, 1, 1); }
+  IPAddress subnetMask() { return IPAddress(255, 255, 255, 0); }
+  IPAddress dnsIP(uint8_t = 0) { return IPAddress(192, 168, 1, 1); }
+  int32_t RSSI() { return -60; }
+  int32_t channel() { return 6; }
+  uint8_t* BSSID() { return bssid; }
+
+ private:
+  uint8_t bssid[6] = {0x02, 0, 0, 0, 0, 1};
+  uint64_t connectAtNs = UINT64_MAX;
+};
+extern ESP8266WiFiClass WiFi;
+
+class WiFiClient {
+ public:
+  bool connected() { return false; }
+  int availableForWrite() { return 0; }
+  size_t write(const uint8_t*, size_t) { return 0; }
+  void stop() {}
+  void setTimeout(unsigned long) {}
+  bool flush(unsigned int = 300) { return true; }
+};
+
+class WiFiServer {
+ public:
+  explicit WiFiServer(uint16_t) {}
+  void begin() {}
+  bool hasClient() { return false; }
+  WiFiClient accept() { return WiFiClient(); }
+};
@@ -0,0 +1,48 @@
+// PubSubClient on the simulated board, connected to the in-process broker
+// stand-in of SimBoard.h. As the real one, publish() fails when the message
+// does not fit in the buffer and loop() hands over one incoming message per
+// call.
+#pragma once
+
+#include <functional>
+#include <ESP8266WiFi.h>
+
+class PubSubClient {
+ public:
+  explicit PubSubClient(WiFiClient&) {}
+
+  PubSubClient& setServer(const char*, uint16_t) { return *this; }
+  PubSubClient& setCallback(std::function<void(char*, uint8_t*, unsigned int)> handler) {
+    callback = handler;
+    return *this;
+  }
+  bool setBufferSize(uint16_t size) {
+    bufferSize = size;
+    return true;
+  }
+  uint16_t getBufferSize() { return bufferSize; }
+  PubSubClient& setSocketTimeout(uint16_t) { return *this; }
+
+  bool connect(const char* id, const char* user, const char* password, const char* willTopic, uint8_t willQos,
+               bool willRetain, const char* willMessage);
+  bool connected() { return isConnected && sim::brokerUp; }
+  int state() { return connected() ? 0 : -2; }
+  bool subscribe(const char* topic);
+  bool loop();
+
+  bool publish(const char* topic, const char* payload) { return publish(topic, payload, false); }
+  bool publish(const char* topic, const char* payload, bool retained) {
+    return publish(topic, (const uint8_t*)payload, strlen(payload), retained);
+  }
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length) {
+    return publish(topic, payload, length, false);
+  }
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained);
+
+ private:
+  std::function<void(char*, uint8_t*, unsigned int)> callback;
+  uint16_t bufferSize = 256;
+  bool isConnected = false;
+  std::vector<std::string> subscriptions;
+  size_t nextIncoming = 0;
+};
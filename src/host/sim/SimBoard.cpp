@@ -0,0 +1,286 @@
+#include "SimBoard.h"
+
+#include <ArduinoOTA.h>
+#include <EEPROM.h>
+#include <PubSubClient.h>
+#include <flash_hal.h>
+
+namespace sim {
+
+std::vector<Message> published;
+bool brokerUp = true;
+uint64_t wifiConnectNs = 300000000;
+bool serialEcho = false;
+
+static uint64_t clockNs = 0;
+static std::vector<Device*> devices;
+
+static uint32_t inputLevels = 0xFFFFFFFF;
+static uint32_t outputLevels = 0;
+static uint32_t outputEnables = 0;
+static void (*handlers[17])() = {};
+
+struct Incoming {
+  uint64_t atNs;
+  std::string topic;
+  std::string payload;
+};
+static std::vector<Incoming> incoming;
+
+static std::vector<uint8_t> flash(FS_PHYS_SIZE, 0xFF);
+
+uint64_t nowNs() {
+  return clockNs;
+}
+
+void attach(Device* device) {
+  devices.push_back(device);
+}
+
+void advanceTo(uint64_t timeNs) {
+  for (;;) {
+    Device* next = nullptr;
+    uint64_t nextNs = timeNs;
+    for (Device* device : devices) {
+      uint64_t eventNs = device->nextEventNs();
+      if (eventNs <= nextNs) {
+        next = device;
+        nextNs = eventNs;
+      }
+    }
+    if (next == nullptr) {
+      break;
+    }
+    if (nextNs > clockNs) {
+      clockNs = nextNs;
+    }
+    next->runEvent();
+  }
+  if (timeNs > clockNs) {
+    clockNs = timeNs;
+  }
+}
+
+void setInput(uint8_t pin, bool level) {
+  if (level) {
+    inputLevels |= 1u << pin;
+  } else {
+    inputLevels &= ~(1u << pin);
+  }
+}
+
+bool outputEnabled(uint8_t pin) {
+  return outputEnables & (1u << pin);
+}
+
+bool outputLevel(uint8_t pin) {
+  return outputLevels & (1u << pin);
+}
+
+bool readPin(uint8_t pin) {
+  return outputEnabled(pin) ? outputLevel(pin) : (inputLevels >> pin) & 1;
+}
+
+void interrupt(uint8_t pin) {
+  if (pin < 17 && handlers[pin] != nullptr) {
+    handlers[pin]();
+  }
+}
+
+void injectMessage(const char* topic, const char* payload, uint64_t atNs) {
+  incoming.push_back({atNs, topic, payload});
+}
+
+}  // namespace sim
+
+HardwareSerial Serial;
+EspClass ESP;
+ESP8266WiFiClass WiFi;
+EEPROMClass EEPROM;
+ArduinoOTAClass ArduinoOTA;
+
+unsigned long millis() {
+  return sim::nowNs() / 1000000;
+}
+
+unsigned long micros() {
+  return sim::nowNs() / 1000;
+}
+
+void delay(unsigned long ms) {
+  sim::advanceTo(sim::nowNs() + ms * 1000000ull);
+}
+
+void delayMicroseconds(unsigned int us) {
+  sim::advanceTo(sim::nowNs() + us * 1000ull);
+}
+
+void yield() {}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (mode == OUTPUT) {
+    sim::outputEnables |= 1u << pin;
+  } else {
+    sim::outputEnables &= ~(1u << pin);
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (value) {
+    sim::outputLevels |= 1u << pin;
+  } else {
+    sim::outputLevels &= ~(1u << pin);
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return sim::readPin(pin);
+}
+
+void attachInterrupt(uint8_t pin, void (*handler)(), int) {
+  sim::handlers[pin] = handler;
+}
+
+void detachInterrupt(uint8_t pin) {
+  sim::handlers[pin] = nullptr;
+}
+
+uint32_t simGpioIn() {
+  return (sim::inputLevels & ~sim::outputEnables) | (sim::outputLevels & sim::outputEnables);
+}
+
+const SimGpioRegister GPOS = {[](uint32_t mask) { sim::outputLevels |= mask; }};
+const SimGpioRegister GPOC = {[](uint32_t mask) { sim::outputLevels &= ~mask; }};
+const SimGpioRegister GPES = {[](uint32_t mask) { sim::outputEnables |= mask; }};
+const SimGpioRegister GPEC = {[](uint32_t mask) { sim::outputEnables &= ~mask; }};
+uint32_t simGpioControl[16];
+
+size_t HardwareSerial::print(const char* text) {
+  if (sim::serialEcho) {
+    fputs(text, stdout);
+  }
+  return strlen(text);
+}
+
+size_t HardwareSerial::print(long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", value);
+  return print(text);
+}
+
+size_t HardwareSerial::print(unsigned long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%lu", value);
+  return print(text);
+}
+
+size_t HardwareSerial::print(const IPAddress& ip) {
+  char text[16];
+  snprintf(text, sizeof(text), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  return print(text);
+}
+
+int HardwareSerial::printf(const char* format, ...) {
+  char text[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  print(text);
+  return length;
+}
+
+rst_info* EspClass::getResetInfoPtr() {
+  static rst_info info = {REASON_DEFAULT_RST};
+  return &info;
+}
+
+void EspClass::restart() {
+  printf("firmware restart at %.3f s\n", sim::nowNs() / 1e9);
+  exit(0);
+}
+
+wl_status_t ESP8266WiFiClass::begin(const char*, const char*, int32_t, const uint8_t*, bool) {
+  connectAtNs = sim::nowNs() + sim::wifiConnectNs;
+  return WL_DISCONNECTED;
+}
+
+wl_status_t ESP8266WiFiClass::status() {
+  return sim::nowNs() >= connectAtNs ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+bool PubSubClient::connect(const char*, const char*, const char*, const char*, uint8_t, bool, const char*) {
+  isConnected = sim::brokerUp;
+  return isConnected;
+}
+
+bool PubSubClient::subscribe(const char* topic) {
+  if (!connected()) {
+    return false;
+  }
+  subscriptions.push_back(topic);
+  return true;
+}
+
+bool PubSubClient::loop() {
+  if (!connected()) {
+    isConnected = false;
+    return false;
+  }
+  for (; nextIncoming < sim::incoming.size(); nextIncoming++) {
+    sim::Incoming& message = sim::incoming[nextIncoming];
+    if (message.atNs > sim::nowNs()) {
+      break;
+    }
+    for (const std::string& topic : subscriptions) {
+      if (topic == message.topic && callback) {
+        // Like the real client: topic and payload live in its buffer, the
+        // payload is not NUL terminated
+        std::vector<char> buffer(message.topic.begin(), message.topic.end());
+        buffer.push_back('\0');
+        buffer.insert(buffer.end(), message.payload.begin(), message.payload.end());
+        callback(buffer.data(), (uint8_t*)buffer.data() + message.topic.size() + 1, message.payload.size());
+        nextIncoming++;
+        return true;
+      }
+    }
+  }
+  return true;
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+  // Fixed header, remaining length, topic length, topic and payload
+  if (!connected() || 5 + 2 + strlen(topic) + length > bufferSize) {
+    return false;
+  }
+  sim::published.push_back({sim::nowNs(), topic, std::string((const char*)payload, length), retained});
+  return true;
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16_t sector) {
+  uint32_t address = sector * SPI_FLASH_SEC_SIZE;
+  if (address < FS_PHYS_ADDR || address + SPI_FLASH_SEC_SIZE > FS_PHYS_ADDR + FS_PHYS_SIZE) {
+    return SPI_FLASH_RESULT_ERR;
+  }
+  memset(&sim::flash[address - FS_PHYS_ADDR], 0xFF, SPI_FLASH_SEC_SIZE);
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_write(uint32_t address, uint32_t* data, uint32_t length) {
+  if (address < FS_PHYS_ADDR || address + length > FS_PHYS_ADDR + FS_PHYS_SIZE || (address | length) & 3) {
+    return SPI_FLASH_RESULT_ERR;
+  }
+  const uint8_t* bytes = (const uint8_t*)data;
+  for (uint32_t i = 0; i < length; i++) {
+    sim::flash[address - FS_PHYS_ADDR + i] &= bytes[i];
+  }
+  return SPI_FLASH_RESULT_OK;
+}
+
+SpiFlashOpResult spi_flash_read(uint32_t address, uint32_t* data, uint32_t length) {
+  if (address < FS_PHYS_ADDR || address + length > FS_PHYS_ADDR + FS_PHYS_SIZE || (address | length) & 3) {
+    return SPI_FLASH_RESULT_ERR;
+  }
+  memcpy(data, &sim::flash[address - FS_PHYS_ADDR], length);
+  return SPI_FLASH_RESULT_OK;
+}
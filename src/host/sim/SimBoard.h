@@ -0,0 +1,62 @@
+// Simulated ESP8266 board, to run the firmware (src/main.cpp) on the host.
+// The Arduino, ESP8266WiFi, PubSubClient, EEPROM, flash and OTA headers in
+// this directory stand in for the real ones on top of it: a virtual clock,
+// the GPIO lines and pin interrupts, the flash and EEPROM contents, and an
+// in-process broker stand-in behind PubSubClient.
+//
+// Nothing runs on its own: the harness calls the firmware's loop() and moves
+// the clock forward in between with advanceTo(), which runs the events of
+// the attached devices (e.g. a simulated panel clocking the bus and calling
+// the clock interrupt) at their time.
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace sim {
+
+const uint32_t cpuMHz = 80;
+
+// Virtual time since the simulated reset
+uint64_t nowNs();
+
+// Hardware with timed events, such as the panel on the other end of the bus
+class Device {
+ public:
+  virtual ~Device() {}
+  // Time of the next event, UINT64_MAX if there is none
+  virtual uint64_t nextEventNs() = 0;
+  // Run the event due at nextEventNs(); the clock is at that time
+  virtual void runEvent() = 0;
+};
+void attach(Device* device);
+
+// Move the clock forward to timeNs, running the device events due on the way
+void advanceTo(uint64_t timeNs);
+
+// GPIO as the firmware sees it
+void setInput(uint8_t pin, bool level);  // level on a pin that is not driven by the firmware
+bool readPin(uint8_t pin);               // level on the pin, driven or not
+bool outputEnabled(uint8_t pin);
+bool outputLevel(uint8_t pin);
+void interrupt(uint8_t pin);             // run the handler attached to the pin, if any
+
+// Broker stand-in. Everything the firmware publishes is kept in published,
+// with the time of the publish() call, i.e. when it left the box.
+struct Message {
+  uint64_t timeNs;
+  std::string topic;
+  std::string payload;
+  bool retained;
+};
+extern std::vector<Message> published;
+extern bool brokerUp;  // the firmware can connect
+// Deliver a message to the firmware: it gets it from the first client.loop()
+// at or after atNs, if it subscribed to the topic
+void injectMessage(const char* topic, const char* payload, uint64_t atNs);
+
+extern uint64_t wifiConnectNs;  // time from WiFi.begin() to a connection
+extern bool serialEcho;         // copy the firmware's Serial output to stdout
+
+}  // namespace sim
@@ -0,0 +1,19 @@
+// Flash access on the simulated board: a 1 MB filesystem area, erased at
+// start. Writes clear bits like NOR flash does, only an erase sets them.
+#pragma once
+
+#include <Arduino.h>
+
+#define FS_PHYS_ADDR 0x300000u
+#define FS_PHYS_SIZE 0x100000u
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+  SPI_FLASH_RESULT_OK,
+  SPI_FLASH_RESULT_ERR,
+  SPI_FLASH_RESULT_TIMEOUT,
+} SpiFlashOpResult;
+
+SpiFlashOpResult spi_flash_erase_sector(uint16_t sector);
+SpiFlashOpResult spi_flash_write(uint32_t address, uint32_t* data, uint32_t length);
+SpiFlashOpResult spi_flash_read(uint32_t address, uint32_t* data, uint32_t length);
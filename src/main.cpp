@@ -6,19 +6,99 @@
 // Also connect crow NEG to Esp8266 GND (pin 6)
 
 #include <Arduino.h>
-#include <deque>
 #include <ESP8266WiFi.h>
 #include <ArduinoOTA.h>
 #include <PubSubClient.h>
 #include <EEPROM.h>
+#include <flash_hal.h>
 #include <ArduinoJson.h>
+#include "SpscRing.h"
+#include "CrowBusReceiver.h"
+#include "CrowDeframer.h"
+#include "CrowDecoder.h"
+#include "CrowKeypad.h"
+#include "CrowTransmitter.h"
+#include "CrowEdgeFilter.h"
+#include "CrowCommand.h"
+#include "CrowPulse.h"
+#include "CrowStats.h"
+#include "CrowEvents.h"
+#include "CrowKeywords.h"
+#include "CrowJournal.h"
+#include "CrowRecorder.h"
+#include "CrowCapture.h"
+#include "CrowOutbox.h"
+#include "CrowScheduler.h"
+#include "CrowRules.h"
+#include "CrowEventPayload.h"
+#include "CrowFrameCache.h"
+#include "CrowFrameRegistry.h"
 
 #define WDT_TIMEOUT_S 8 // Set the WDT timeout to 8 seconds
 
-const int statusAddress = 0;
-byte status = 0;
+// Set to 1 (or build with -DSECOND_BUS=1) to watch a second panel on D1
+// (clock) and D2 (data), published under "Alarm2/". Those are the parcial and
+// total keyswitch relay pins, so only the alarme relay is left.
+#ifndef SECOND_BUS
+#define SECOND_BUS 0
+#endif
+
+const int statusAddress = 0; // single byte EEPROM copy of the status used by older versions
+const int formatAddress = 1; // one byte per bus with the topics sent as binary events
+const int wifiProfileAddress = 3; // WifiProfile of the last good Wi-Fi connection
+
+// Access point and IP settings of the last good Wi-Fi connection. Connecting
+// with them skips the channel scan and DHCP, see maintainWifi().
+struct WifiProfile {
+  uint8_t magic;
+  uint8_t channel;
+  uint8_t bssid[6];
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint32_t checksum;
+};
+const uint8_t wifiProfileMagic = 0xA5;
+const size_t eepromSize = wifiProfileAddress + sizeof(WifiProfile);
 byte statussaved = 0;
 
+// The status of each bus is persisted in a journal spread over the last
+// sectors of the filesystem area (not used by this firmware), see
+// CrowJournal.h. The flight recorder snapshots go in the sectors just below
+// the first bus's journal, the second bus's journal below those, and then a
+// sector per bus with its rules.
+const uint16_t journalSectors = 4;
+const uint16_t recorderSectors = 2;
+const uint16_t rulesSectors = 1;
+
+class EspFlashRegion : public CrowFlashRegion {
+ public:
+  void begin(uint32_t firstSector, uint16_t sectors) {
+    first = firstSector;
+    count = sectors;
+  }
+  uint16_t sectorCount() const override {
+    return count;
+  }
+  bool read(uint32_t offset, uint32_t* data, uint32_t length) override {
+    return spi_flash_read(first * SPI_FLASH_SEC_SIZE + offset, data, length) == SPI_FLASH_RESULT_OK;
+  }
+  bool write(uint32_t offset, const uint32_t* data, uint32_t length) override {
+    return spi_flash_write(first * SPI_FLASH_SEC_SIZE + offset, (uint32_t*)data, length) == SPI_FLASH_RESULT_OK;
+  }
+  bool eraseSector(uint16_t sector) override {
+    return spi_flash_erase_sector(first + sector) == SPI_FLASH_RESULT_OK;
+  }
+
+ private:
+  uint32_t first = 0;
+  uint16_t count = 0;
+};
+
+EspFlashRegion recorderFlash;
+CrowRecorder recorder(recorderFlash); // last frames and events, dumped with the "recorder" command
+
 unsigned long startupTime;
 
 const char* ssid = "YourWifiSSID";
@@ -29,434 +109,1478 @@ const int mqttPort = 1883; //port used by the Mqtt broker - usually 1883
 const char* mqttID = "AlarmESP8266";
 const char* mqttUser = "YourMqttUsername";
 const char* mqttPassword = "YourMqttPassword";
-const char* mqttTopic = "Alarm/active_zones";
-const char* mqttStateTopic = "Alarm/status";
-const char* mqttControlTopic = "Alarm/control"; //this topic is used to control the alarm activation, as well as to activate debug data for the alarm protocol - this data was extremely usefull for the development, but is probably irrelevant now
+// Topics of the board itself. Each bus has its own set too, see AlarmBus.
 const char* lwtTopic = "Alarm/lwt";
 const char* birthMessage = "Online";
 const char* lwtMessage = "Offline";
-const char* activeZoneTopic = "Alarm/active_zone_data"; //Topic for debug data
-const char* debugTopic = "Alarm/debug_data"; //Topic for debug data
 const char* logTopic = "Alarm/log"; //Topic where parts of the log are published, like restart reason and some changes to the status
-const char* teleTopic = "Alarm/tele"; //Topic for the telemetry
+const char* teleTopic = "Alarm/tele"; //Topic for the telemetry, with the first bus's counters
+const char* recorderTopic = "Alarm/recorder"; //Topic for the binary flight recorder dumps, read them with crowtool
+const char* captureTopic = "Alarm/capture"; //Topic for the binary raw capture batches, read them with crowtool
+const char* teleTasksTopic = "Alarm/tele_tasks"; //Topic for the loop() task runtimes, published with the telemetry
+const char* replayTopic = "Alarm/replayed"; //Topic where messages sent late after an outage are repeated as "<age ms> <topic> <payload>"
 
 const char* resetCause;
 
-const int clockPin = D6;
-const int dataPin = D7;
+constexpr uint8_t clockPin = D6;
+constexpr uint8_t dataPin = D7;
+#if SECOND_BUS
+constexpr uint8_t clockPin2 = D1;
+constexpr uint8_t dataPin2 = D2;
+#endif
 const int parcialPin = D1;
 const int totalPin = D2;
 const int alarmePin = D5;
 
-const int boundaryLen = 8;
-const int bufferSize = 128;
-
 bool debugalarme = false;
 bool zonedata = false;
 
-std::deque<int> dataBuffer;
-int insideState = 1;
-int consecutiveOnes = 0;
-int boundaryAge = 0;
-bool cansend = false;
-// Define the size of the binary array in bytes
-const int binarySizeBytes = 1;  // 8 bits
+// Direct GPIO register access for the bus pins in the ISR, with the pin fixed
+// at compile time, instead of going through digitalRead()/digitalWrite().
+// The pin must have been set up as a GPIO with pinMode() first.
+template <uint8_t Pin>
+struct FastPin {
+  static_assert(Pin < 16, "FastPin handles GPIO 0 to 15 only");
+  static CROW_ALWAYS_INLINE bool read() { return GPI & (1u << Pin); }
+  static CROW_ALWAYS_INLINE void write(bool high) {
+    if (high) {
+      GPOS = 1u << Pin;
+    } else {
+      GPOC = 1u << Pin;
+    }
+  }
+  static CROW_ALWAYS_INLINE void output() { GPES = 1u << Pin; }  // enable the output driver
+  static CROW_ALWAYS_INLINE void input() { GPEC = 1u << Pin; }   // release the line
+};
+
+// Clock edges closer together than this are glitches, see CrowEdgeFilter.h.
+// Can be changed with the "glitchfilter:<us>" command, 0 turns it off. Off
+// until a threshold has been measured on real panels.
+const uint32_t glitchFilterUs = 0;
+
+// Pause between two keypress packets
+const unsigned long txGapMs = 50;
+
+// The clock ISR of each bus samples the data line and packs the bits, MSB
+// first, into bytes that are handed to loop() through the ring of its
+// receiver. All decoding happens in processBusBits(), outside interrupt
+// context. The only other work done in the ISR is driving the transmitter.
+CrowBusReceiver<FastPin<clockPin>, FastPin<dataPin>> receiver;
+#if SECOND_BUS
+CrowBusReceiver<FastPin<clockPin2>, FastPin<dataPin2>> receiver2;
+#endif
+
+const size_t busTopicBytes = 32;
+
+// Topics that can carry the binary event payload instead of text, see
+// CrowEventPayload.h; set with "binario:<topics>"
+enum BinaryTopic : uint8_t {
+  binaryStatus = 1,
+  binaryZones = 2,
+  binaryActiveZones = 4,
+  binaryAll = 7,
+};
+
+uint32_t cycleCount() {
+  return ESP.getCycleCount();
+}
+
+// One Crow panel: the receiver its clock ISR feeds and everything loop()
+// keeps for it. Its topics are the usual ones under its own prefix, so the
+// first bus publishes on "Alarm/status" and a second one on "Alarm2/status".
+class AlarmBus {
+ public:
+  AlarmBus(const char* prefix, CrowBusPort& port)
+      : prefix(prefix), port(port), statusJournal(journalFlash), rules(cycleCount) {}
+
+  // Build the topic names, before anything is published
+  void begin() {
+    makeTopic(activeZonesTopic, "active_zones");
+    makeTopic(stateTopic, "status");
+    makeTopic(controlTopic, "control");
+    makeTopic(zonesTopic, "zones");
+    makeTopic(resultTopic, "result");
+    makeTopic(logTopic, "log");
+    makeTopic(teleTopic, "tele");
+    makeTopic(debugTopic, "debug_data");
+    makeTopic(activeZoneTopic, "active_zone_data");
+    makeTopic(rulesTopic, "rules");
+    makeTopic(teleRulesTopic, "tele_rules");
+  }
+
+  const char* prefix;
+  CrowBusPort& port;
+  CrowDeframer deframer;
+  byte status = 0;
+  uint16_t rxBacklogMax = 0;          // ring high-water mark seen by loop()
+
+  // Bus health instrumentation, in CPU cycles, from <256 cycles upwards
+  CrowHistogram<8, 8> deframeCycles;  // deframing cost per captured byte (8 bus bits)
+  CrowHistogram<8, 8> decodeCycles;   // status/zone decode cost per complete frame
+  CrowRateMeter busClockRate;         // clock edges per second
+
+  // Repeated frames skip the decode, see printBuffer()
+  CrowFrameCache frameCache;
+
+  // Frames by type, see frameRegistry
+  uint32_t keypressFrames = 0;   // keypress packets on the bus, ours included
+  uint32_t unknownFrames = 0;    // frames of a type with no handler
+  int16_t lastUnknownHeader = -1;
+
+  // Only real status/zone changes are published, see processEvents()
+  CrowEventFilter eventFilter;
+  uint32_t statusZonePublishes = 0;
+  uint8_t binaryTopics = 0;   // BinaryTopic bits, text for the others
+  uint8_t eventSequence = 0;  // of the binary event messages
+
+  // Arm/disarm keypress sequences waiting for the panel to confirm them
+  CrowCommandPipeline commandPipeline;
+
+  EspFlashRegion journalFlash;
+  CrowStatusJournal statusJournal;
+
+  // Local automation, run on the decoded frames, see CrowRules.h
+  CrowRuleEngine rules;
+  EspFlashRegion rulesFlash;
+
+  char activeZonesTopic[busTopicBytes]; // "<zone> activo" and "<zone> triggered"
+  char stateTopic[busTopicBytes];
+  char controlTopic[busTopicBytes];     // this topic is used to control the alarm activation, as well as to activate debug data for the alarm protocol
+  char zonesTopic[busTopicBytes];       // the active and triggered zones as JSON, only published on changes
+  char resultTopic[busTopicBytes];      // the outcome of arm/disarm commands sent over the bus
+  char logTopic[busTopicBytes];         // what the control commands did
+  char teleTopic[busTopicBytes];        // counters of the second bus, the first one's are in the board telemetry
+  char debugTopic[busTopicBytes];       // every frame, with "debugon"
+  char activeZoneTopic[busTopicBytes];  // zone frames with something active, with "zonedataon"
+  char rulesTopic[busTopicBytes];       // rule text to store and run, see CrowRules.h
+  char teleRulesTopic[busTopicBytes];   // evaluation count and cost of each rule
+
+ private:
+  template <size_t N>
+  void makeTopic(char (&topic)[N], const char* name) {
+    snprintf(topic, N, "%s/%s", prefix, name);
+  }
+};
+
+AlarmBus buses[] = {
+  {"Alarm", receiver},
+#if SECOND_BUS
+  {"Alarm2", receiver2},
+#endif
+};
+const uint8_t busCount = sizeof(buses) / sizeof(buses[0]);
+
+// Flight recorder cost per frame, in CPU cycles
+CrowHistogram<8, 6> recordCycles;
+
+// Raw capture of every frame of the first bus, in binary batches sent to
+// captureTopic ("capture-mqtt") or to a client of captureTcpPort
+// ("capture-tcp") instead of one hex publish per frame like debugon
+enum CaptureMode : uint8_t { captureOff, captureMqtt, captureTcp };
+CaptureMode captureMode = captureOff;
+CrowCaptureBatcher capture;
+const uint16_t captureTcpPort = 2323;
+WiFiServer captureServer(captureTcpPort);
+WiFiClient captureClient;
 
 WiFiClient espClient;
 PubSubClient client(espClient);
+
+// Everything but the big binary/telemetry messages is published through the
+// outbox, so nothing is lost while the broker or Wi-Fi is away; see
+// mqttPublish() and maintainMqtt()
+CrowOutbox outbox;
+CrowBackoff mqttBackoff(1000, 60000); // between connection attempts, doubling up to 1 minute
+const unsigned long replayNoteMs = 2000; // messages sent this late are also reported on replayTopic
+const uint8_t outboxBurst = 8; // messages sent per flushOutbox() call
+const size_t mqttHeaderBytes = 7; // PubSubClient's fixed header and the topic length
+uint32_t mqttConnects = 0;
+uint32_t reportedDrops = 0;
+
+// Boot milestones in millis(), 0 until reached. setup() only brings up the
+// bus; Wi-Fi, OTA and MQTT come up in the background from processNetwork()
+// and everything published until then waits in the outbox.
+uint32_t bootFirstFrameMs = 0;
+uint32_t bootWifiMs = 0;
+uint32_t bootMqttMs = 0;
+uint32_t bootFirstPublishMs = 0;
+bool bootReported = false;
+bool otaStarted = false;
 bool otaInProgress = false;
 
-unsigned long previousMillis = 0;
-unsigned long previousMillistele = 0;
-const unsigned long interval = 1000;
-const unsigned long intervaltele = 10000;
-unsigned long lastActivationTime = 0;
-
-void activatePin(int pin, unsigned long duration) {
-  digitalWrite(pin, HIGH);
-  lastActivationTime = millis();
-  while (millis() - lastActivationTime < duration) {
-    // Wait for the specified duration
-    ESP.wdtFeed();
-    yield();
-  }
-  digitalWrite(pin, LOW);
-}
-
-void publishStatus(byte estado) {
-  switch (estado) {
-      case 0:
-        client.publish(mqttStateTopic, "Desarmado", true);
-        break;
-      case 1:
-        client.publish(mqttStateTopic, "Armado Total", true);
-        break;
-      case 2:
-        client.publish(mqttStateTopic, "Armado Parcial", true);
-        break;
-      case 3:
-        client.publish(mqttStateTopic, "Alarme Despoletado", true);
-        break;
-      case 4:
-        client.publish(mqttStateTopic, "Chime", true);
-        break;
-      case 5:
-        client.publish(mqttStateTopic, "A armar Total", true);
-        break;
-      case 6:
-        client.publish(mqttStateTopic, "A armar Parcial", true);
-        break;
-    }
-}
-
-void printBuffer(const std::deque<int>& buffer, unsigned int length) {
-  if (buffer.size() >= length) {
-    unsigned int inicio = buffer.size() - length;
-    for (unsigned int i = inicio; i < buffer.size(); i++) {
-      Serial.print(buffer[i]);
-    }
-    Serial.println();
-
-    if (debugalarme) {
-      String hexValue = "";
-      for (unsigned int i = inicio; i < buffer.size(); i += 8) {
-        int value = 0;
-        for (int j = 0; j < 8; j++) {
-            value |= (buffer[i + j] << (7 - j));
-        }
-        // Pad the hexadecimal value with leading zeros to ensure it always has 2 characters
-        String hexByte = String(value, HEX);
-        if (hexByte.length() == 1) {
-            hexByte = "0" + hexByte; // Add a leading zero if necessary
-        }
-        hexValue += hexByte;
-      }
-      client.publish(debugTopic, hexValue.c_str());
-    }
-
-    if (length == 72) {
-      bool activeZoneDetected = false;
-      int multiplicador = 0;
-      int multiplic = inicio + 16;
-      int statusrep = inicio + 63;
-      int statu1 = inicio + 24;
-      int statu2 = inicio + 25;
-      int statu3 = inicio + 27;
-      int jaarmado = inicio + 26;
-      int total = inicio + 48;
-      int parcial = inicio + 56;
-      if (buffer[statusrep] == 0) {  //bit 63 is 0 when the messages report the zones and not status changes
-        if (buffer[multiplic] == 1) {  //bit 16 is 1 when the the active zones are from 9 to 16
-          multiplicador = 8; //so you must add 8 to the index number to get the actual zone
-          }
-        for (unsigned int i = inicio + 24; i < inicio + 32; i++) {
-          if (buffer[i] == 1) {
-            char message[20];
-            snprintf(message, sizeof(message), "%d activo", i - inicio - 23 + multiplicador);
-            client.publish(mqttTopic, message);
-            Serial.print(message);
-            Serial.println();
-            activeZoneDetected = true;
-          }
-        }
-        for (unsigned int i = inicio + 32; i < inicio + 40; i++) { //when the alarm is triggered, the triggered zone is in these bits
-          if (buffer[i] == 1) {
-            char message[20];
-            snprintf(message, sizeof(message), "%d triggered", i - inicio - 31 + multiplicador);
-            client.publish(mqttTopic, message);
-            Serial.print(message);
-            Serial.println();
-            activeZoneDetected = true;
-          }
-        }
-      } else { //handle status messages
-        if (buffer[statu1] == 1 && buffer[statu2] == 1 && buffer[statu3] == 1) { //triggered
-          if (buffer[jaarmado] == 1) {
-            status = 3;
-            Serial.println("Disparado");
-          } else {
-            status = 4;
-            Serial.println("Chime");
-          }
-        } else if (buffer[statu1] == 1 && buffer[statu2] == 0 && buffer[jaarmado] == 1) { //disarmed
-            status = 0;
-            Serial.println("Desarmado");
-        } else if (buffer[parcial] == 1 && status != 3) { //bit 56 is 1 when the alarm is armed partially and 0 if totally
-          if ((buffer[statu2] == 0 && buffer[jaarmado] == 1) || (buffer[statu1] == 1 && buffer[statu3] == 0 && status != 6)) {
-            Serial.println("Armado Parcial");
-            status = 2;
-          } else if (status != 2) {
-            Serial.println("A armar Parcial");
-            status = 6;
-          }
-        } else if (buffer[total] == 1 && status != 3) {
-          if ((buffer[statu2] == 0 && buffer[jaarmado] == 1) || (buffer[statu1] == 1 && buffer[statu3] == 0 && status != 5)) {
-            Serial.println("Armado Total");
-            status = 1;
-          } else if (status != 1) {
-            Serial.println("A armar Total");
-            status = 5;
-          }
-        } else if (status != 3) { //disarmed
-          status = 0;
-          Serial.println("Desarmado");
-        } else if (buffer[statu1] == 0) { //disarm successful
-          status = 0;
-          Serial.println("Desarmado");
-        }
-        publishStatus(status);
-        //prevent unnecessary writting to flash
-        EEPROM.get(statusAddress, statussaved);
-        if (statussaved != status) {
-          EEPROM.put(statusAddress, status);
-          EEPROM.commit(); // Commit the changes to EEPROM
-        }
-        
-      }
-      if (activeZoneDetected && zonedata) {
-        String hexValue = "";
-        for (unsigned int i = inicio; i < buffer.size(); i += 8) {
-          int value = 0;
-          for (int j = 0; j < 8; j++) {
-              value |= (buffer[i + j] << (7 - j));
-          }
-          // Pad the hexadecimal value with leading zeros to ensure it always has 2 characters
-          String hexByte = String(value, HEX);
-          if (hexByte.length() == 1) {
-              hexByte = "0" + hexByte; // Add a leading zero if necessary
-          }
-          hexValue += hexByte;
+// Wi-Fi connection manager: a fast connect with the saved profile first,
+// then the normal scan and DHCP if it doesn't connect within
+// wifiFastTimeoutMs, or if MQTT can't be reached wifiFastMqttAttempts times
+// after it. A full connect is retried after wifiFullTimeoutMs.
+enum WifiState : uint8_t {
+  wifiFast,       // connecting with the saved channel, BSSID and IP
+  wifiFull,       // connecting with a scan and DHCP
+  wifiConnected,
+};
+const unsigned long wifiFastTimeoutMs = 1500;
+const unsigned long wifiFullTimeoutMs = 20000;
+const uint8_t wifiFastMqttAttempts = 3;
+WifiProfile wifiProfile;
+bool wifiProfileValid = false;
+uint8_t wifiState = wifiFull;
+uint32_t wifiConnectStartMs = 0; // when the connection was lost, or the boot
+uint32_t wifiAttemptMs = 0;      // start of the current attempt
+uint32_t wifiConnectMs = 0;      // time the last connection took
+uint32_t wifiAttempts = 0;
+uint32_t wifiConnects = 0;
+uint32_t wifiFastConnects = 0;
+uint32_t wifiFallbacks = 0;      // fast connects that failed, or were connected but unusable
+bool wifiFastUnverified = false; // connected with the saved profile, MQTT not reached yet
+uint8_t wifiFastMqttFailures = 0;
+
+// OTA update in progress: start time, end of the last bus service and the
+// longest time between two, the blind window, and the ring overflows at the
+// start
+uint32_t otaStartMs = 0;
+uint32_t otaServicedMs = 0;
+uint32_t otaBlindMs = 0;
+uint32_t otaStartOverflows = 0;
+
+const unsigned long interval = 1000; // watchdog feed period
+const unsigned long intervaltele = 10000; // telemetry period
+
+// Keyswitch relays, one pulse scheduler channel each
+const uint8_t relayCount = 3;
+const int relayPins[relayCount] = {parcialPin, totalPin, alarmePin};
+const char* const relayCommands[relayCount] = {"parcialpin", "totalpin", "alarmepin"};
+const char* const relayLogMessages[relayCount] = {
+  "Activado Keyswitch da Guarda Parcial",
+  "Activado Keyswitch da Guarda Total",
+  "Alarme despoletado activamente",
+};
+// With a second bus, D1 and D2 are its clock and data lines
+const bool relayAvailable[relayCount] = {!SECOND_BUS, !SECOND_BUS, true};
+CrowPulseScheduler relays;
+
+// Send queued messages, most important first, while the connection takes them
+void flushOutbox() {
+  if (!client.connected()) {
+    return;
+  }
+  for (uint8_t i = 0; i < outboxBurst; i++) {
+    const CrowOutboxMessage* message = outbox.front();
+    if (message == nullptr ||
+        !client.publish(message->topic, (const uint8_t*)message->payload, message->length, message->retained)) {
+      return;
+    }
+    if (bootFirstPublishMs == 0) {
+      bootFirstPublishMs = millis();
+    }
+    unsigned long age = millis() - message->queuedMs;
+    if (age >= replayNoteMs) {
+      char note[2 * crowOutboxPayloadBytes + 48];
+      int length = snprintf(note, sizeof(note), "%lu %s ", age, message->topic);
+      if (message->binary) {
+        // As hex, like the debug frames
+        for (uint8_t i = 0; i < message->length; i++) {
+          length += snprintf(note + length, sizeof(note) - length, "%02x", (uint8_t)message->payload[i]);
         }
-        client.publish(activeZoneTopic, hexValue.c_str());
+      } else {
+        snprintf(note + length, sizeof(note) - length, "%s", message->payload);
       }
+      client.publish(replayTopic, note);
     }
+    outbox.pop();
   }
 }
 
-void IRAM_ATTR clockCallback() {
-  // Check if OTA update is in progress, and disable the interrupt if it is
-  if (otaInProgress) {
+void mqttPublish(const char* topic, const char* payload, bool retained = false,
+                 uint8_t priority = crowPriorityNormal) {
+  if (!outbox.push(topic, payload, retained, priority, millis())) {
+    Serial.println("Outbox cheia, mensagem perdida");
+  }
+  flushOutbox();
+}
+
+void checkFastConnect(bool mqttConnected);
+
+// One connection attempt at a time, never waiting in a loop; failed
+// attempts back off exponentially
+void maintainMqtt() {
+  if (client.connected() || WiFi.status() != WL_CONNECTED || !mqttBackoff.due(millis())) {
     return;
   }
-  int dbit = digitalRead(dataPin);
-  bool boundaryfound = false;
-    if (dbit == 1) {
-      dataBuffer.push_back(dbit);
-      boundaryAge++;
-      consecutiveOnes++;
-    } else {
-      if (consecutiveOnes == 6) {
-        boundaryfound = true;
-      }
-      if (consecutiveOnes != 5) {
-        dataBuffer.push_back(dbit);
-        boundaryAge++;
+  Serial.println("Connecting to MQTT...");
+  bool connected = client.connect(mqttID, mqttUser, mqttPassword, lwtTopic, 0, 1, lwtMessage);
+  checkFastConnect(connected);
+  if (!connected) {
+    mqttBackoff.failed(millis());
+    Serial.printf("Failed, rc=%d. Retrying in %lu ms\n", client.state(), (unsigned long)mqttBackoff.delay());
+    return;
+  }
+  Serial.println("Connected to MQTT");
+  if (bootMqttMs == 0) {
+    bootMqttMs = millis();
+  }
+  mqttBackoff.reset();
+  client.publish(lwtTopic, birthMessage, true);
+  for (AlarmBus& bus : buses) {
+    client.subscribe(bus.controlTopic);
+    client.subscribe(bus.rulesTopic);
+  }
+  if (mqttConnects++ > 0) {
+    mqttPublish(logTopic, "Reconnected to MQTT");
+  }
+  if (outbox.dropped != reportedDrops) {
+    char message[48];
+    snprintf(message, sizeof(message), "%lu mensagens perdidas", (unsigned long)(outbox.dropped - reportedDrops));
+    reportedDrops = outbox.dropped;
+    mqttPublish(logTopic, message, false, crowPriorityHigh);
+  }
+  flushOutbox();
+}
+
+uint32_t wifiProfileChecksum(const WifiProfile& profile) {
+  const uint8_t* bytes = (const uint8_t*)&profile;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(WifiProfile, checksum); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+void loadWifiProfile() {
+  EEPROM.get(wifiProfileAddress, wifiProfile);
+  wifiProfileValid = wifiProfile.magic == wifiProfileMagic && wifiProfile.channel != 0 &&
+                     wifiProfile.checksum == wifiProfileChecksum(wifiProfile);
+}
+
+// Remember the connection that just came up, if it differs from the saved one
+void saveWifiProfile() {
+  WifiProfile profile = {};
+  profile.magic = wifiProfileMagic;
+  profile.channel = WiFi.channel();
+  memcpy(profile.bssid, WiFi.BSSID(), sizeof(profile.bssid));
+  profile.ip = WiFi.localIP();
+  profile.gateway = WiFi.gatewayIP();
+  profile.subnet = WiFi.subnetMask();
+  profile.dns = WiFi.dnsIP();
+  profile.checksum = wifiProfileChecksum(profile);
+  if (!wifiProfileValid || memcmp(&profile, &wifiProfile, sizeof(profile)) != 0) {
+    wifiProfile = profile;
+    wifiProfileValid = true;
+    EEPROM.put(wifiProfileAddress, wifiProfile);
+    EEPROM.commit();
+  }
+}
+
+void beginWifi(bool fast) {
+  wifiAttempts++;
+  wifiAttemptMs = millis();
+  if (fast) {
+    wifiState = wifiFast;
+    WiFi.config(wifiProfile.ip, wifiProfile.gateway, wifiProfile.subnet, wifiProfile.dns);
+    WiFi.begin(ssid, password, wifiProfile.channel, wifiProfile.bssid);
+  } else {
+    wifiState = wifiFull;
+    WiFi.config(0u, 0u, 0u); // back to DHCP
+    WiFi.begin(ssid, password);
+  }
+}
+
+// Non-blocking Wi-Fi connection and reconnection, see WifiState
+void maintainWifi() {
+  uint32_t now = millis();
+  wl_status_t status = WiFi.status();
+  if (status == WL_CONNECTED) {
+    if (wifiState != wifiConnected) {
+      wifiConnectMs = now - wifiConnectStartMs;
+      wifiConnects++;
+      if (wifiState == wifiFast) {
+        wifiFastConnects++;
       }
-      consecutiveOnes = 0;
+      wifiFastUnverified = wifiState == wifiFast;
+      wifiFastMqttFailures = 0;
+      wifiState = wifiConnected;
+      saveWifiProfile();
     }
+    return;
+  }
+  if (wifiState == wifiConnected) {
+    wifiConnectStartMs = now;
+    beginWifi(wifiProfileValid);
+  } else if (wifiState == wifiFast) {
+    // Access point gone from that channel, or the saved settings no longer work
+    if (status == WL_NO_SSID_AVAIL || status == WL_CONNECT_FAILED || now - wifiAttemptMs > wifiFastTimeoutMs) {
+      wifiFallbacks++;
+      beginWifi(false);
+    }
+  } else if (now - wifiAttemptMs > wifiFullTimeoutMs) {
+    beginWifi(wifiProfileValid);
+  }
+}
+
+// A fast connect reaches WL_CONNECTED even when the saved settings no longer
+// work (router replaced, subnet changed, address leased to another host), so
+// it only counts once MQTT is reached. Otherwise forget the profile and
+// connect again with a scan and DHCP.
+void checkFastConnect(bool mqttConnected) {
+  if (!wifiFastUnverified) {
+    return;
+  }
+  if (!mqttConnected && ++wifiFastMqttFailures < wifiFastMqttAttempts) {
+    return;
+  }
+  wifiFastUnverified = false;
+  if (mqttConnected) {
+    return;
+  }
+  Serial.println("Perfil Wi-Fi sem rede, a ligar com DHCP");
+  wifiProfileValid = false;
+  wifiFallbacks++;
+  wifiConnectStartMs = millis();
+  WiFi.disconnect();
+  beginWifi(false);
+}
+
+// Background network bring-up: Wi-Fi, OTA once it has an address, then MQTT
+void processNetwork() {
+  maintainWifi();
+  if (!otaStarted && WiFi.status() == WL_CONNECTED) {
+    bootWifiMs = millis();
+    Serial.print("Connected to WiFi, IP: ");
+    Serial.print(WiFi.localIP());
+    Serial.print(" RSSI: ");
+    Serial.println(WiFi.RSSI());
+    ArduinoOTA.begin();
+    otaStarted = true;
+  }
+  maintainMqtt();
+  if (!bootReported && bootFirstPublishMs != 0) {
+    char message[128];
+    snprintf(message, sizeof(message), "Boot: primeira trama %lu ms, Wi-Fi %lu ms, MQTT %lu ms, primeira publicacao %lu ms",
+             (unsigned long)bootFirstFrameMs, (unsigned long)bootWifiMs, (unsigned long)bootMqttMs,
+             (unsigned long)bootFirstPublishMs);
+    mqttPublish(logTopic, message);
+    bootReported = true;
+  }
+}
 
-  if (dataBuffer.size() > bufferSize) {
-    dataBuffer.pop_front();
+// Drive the relay outputs from the pulse scheduler and report finished pulses
+void processRelays() {
+  relays.update(millis());
+  uint8_t changed = relays.changedMask();
+  for (uint8_t i = 0; i < relayCount; i++) {
+    if (changed & (1 << i)) {
+      digitalWrite(relayPins[i], relays.level(i) ? HIGH : LOW);
+    }
+  }
+  uint8_t completed = relays.takeCompleted();
+  for (uint8_t i = 0; i < relayCount; i++) {
+    if (completed & (1 << i)) {
+      char message[32];
+      snprintf(message, sizeof(message), "%s ok", relayCommands[i]);
+      mqttPublish(buses[0].resultTopic, message);
+    }
   }
+}
 
-  if (consecutiveOnes >= 10 && insideState == 0) {
-    consecutiveOnes = 10; //prevent from increasing too much
-    cansend = true;
+// Without flash set aside for the journal (an ldscript with little or no FS
+// area) the first bus keeps its status in the EEPROM byte, as it always did
+bool statusInEeprom(AlarmBus& bus) {
+  return !bus.statusJournal.active() && &bus == &buses[0];
+}
+
+bool eepromStatusPending = false; // changed during an OTA update, written after it
+
+void saveStatus(AlarmBus& bus) {
+  if (statusInEeprom(bus)) {
+    // Not between two chunks of the image, see serviceDuringOta()
+    if (otaInProgress) {
+      eepromStatusPending = true;
+      return;
+    }
+    eepromStatusPending = false;
+    uint8_t status = crowStableStatus(bus.status);
+    if (EEPROM.read(statusAddress) != status) {
+      EEPROM.write(statusAddress, status);
+      EEPROM.commit();
+    }
+    return;
+  }
+  // Written later from loop(), and only once the status has settled
+  bus.statusJournal.record(bus.status, millis());
+}
+
+void mqttPublishEvent(AlarmBus& bus, const char* topic, uint8_t status, uint8_t flags, uint16_t activeZones,
+                      uint16_t triggeredZones, bool retained, uint8_t priority) {
+  CrowEventPayload event;
+  event.status = status;
+  event.activeZones = activeZones;
+  event.triggeredZones = triggeredZones;
+  event.flags = flags;
+  event.sequence = bus.eventSequence++;
+  event.timeMs = millis();
+  uint8_t payload[crowEventPayloadBytes];
+  size_t length = crowEncodeEventPayload(event, payload);
+  if (!outbox.pushBinary(topic, payload, length, retained, priority, millis())) {
+    Serial.println("Outbox cheia, mensagem perdida");
+  }
+  flushOutbox();
+}
+
+void publishStatus(AlarmBus& bus, byte estado) {
+  const char* name = crowStatusName(estado);
+  if (name == nullptr) {
+    return;
+  }
+  if (bus.binaryTopics & binaryStatus) {
+    mqttPublishEvent(bus, bus.stateTopic, estado, crowEventFlagStatus, 0, 0, true, crowPriorityHigh);
   } else {
-    cansend = false;
+    mqttPublish(bus.stateTopic, name, true, crowPriorityHigh);
   }
+}
 
-  if (dataBuffer.size() == bufferSize && boundaryfound) {
-    if (boundaryAge % 8 != 0) {
-      insideState = 0;
+// Status and zone frames from the panel
+void onPanelFrame(AlarmBus& bus, const CrowFrame& frame) {
+  CrowDecoded decoded;
+  uint32_t startCycles = ESP.getCycleCount();
+  bool known = crowDecodeFrame(frame, bus.status, decoded);
+  bus.decodeCycles.record(ESP.getCycleCount() - startCycles);
+  if (!known) {
+    return;
+  }
+  bus.frameCache.store(frame, bus.status, decoded);
+  if (bootFirstFrameMs == 0) {
+    bootFirstFrameMs = millis();
+  }
+  bool activeZoneDetected = false;
+  if (!decoded.isStatus) {
+    //when the alarm is triggered, the triggered zone is in triggeredZones
+    bus.eventFilter.onZones(decoded.zoneMask, decoded.activeZones, decoded.triggeredZones, millis());
+    bus.rules.onZones(decoded.zoneMask, decoded.activeZones, decoded.triggeredZones, millis());
+    activeZoneDetected = decoded.activeZones != 0 || decoded.triggeredZones != 0;
+  } else { //handle status messages
+    if (&bus == &buses[0] && decoded.status != bus.status) {
+      recorder.recordStatus(bus.status, decoded.status, millis());
     }
-    if (insideState == 1) {
-      int messagesize = boundaryAge + boundaryLen;
-      printBuffer(dataBuffer, messagesize);
+    bus.status = decoded.status;
+    bus.commandPipeline.onStatus(bus.status, millis());
+    bus.eventFilter.onStatus(bus.status, millis());
+    bus.rules.onStatus(bus.status);
+    saveStatus(bus);
+  }
+  if (activeZoneDetected && zonedata) {
+    char hexValue[2 * crowMaxFrameBytes + 1];
+    crowFrameToHex(frame, hexValue);
+    mqttPublish(bus.activeZoneTopic, hexValue, false, crowPriorityLow);
+  }
+}
+
+// Keypress packets: the keypads', and ours as they go out on the bus
+void onKeypressFrame(AlarmBus& bus, const CrowFrame&) {
+  bus.keypressFrames++;
+}
+
+// Handlers by frame type, registered in setup(). Unknown types are only
+// counted, with the last header seen, to tell what else is on the bus.
+CrowFrameRegistry<AlarmBus> frameRegistry;
+
+void printBuffer(AlarmBus& bus, const CrowFrame& frame) {
+  // The capture and the flight recorder follow the first bus
+  bool primary = &bus == &buses[0];
+  if (primary && captureMode != captureOff) {
+    capture.add(frame, ESP.getCycleCount(), millis());
+  }
+
+  // A repeat of the last frame of its type changes nothing. Only what needs
+  // to see every frame gets it (zone hold times, command acks, rules on a
+  // zone reported again after a silence), without the hex, decode, recorder
+  // or journal. debugon and zonedataon want every frame.
+  CrowDecoded decoded;
+  if (!debugalarme && !zonedata && bus.frameCache.lookup(frame, bus.status, decoded)) {
+    if (decoded.isStatus) {
+      bus.commandPipeline.onStatus(bus.status, millis());
+      bus.eventFilter.onStatus(bus.status, millis());
+      bus.rules.onStatus(bus.status);
+    } else {
+      bus.eventFilter.onZones(decoded.zoneMask, decoded.activeZones, decoded.triggeredZones, millis());
+      bus.rules.onZones(decoded.zoneMask, decoded.activeZones, decoded.triggeredZones, millis());
     }
-    insideState = insideState == 0 ? 1 : 0;
-    boundaryAge = 0;
+    return;
+  }
+
+  char hexValue[2 * crowMaxFrameBytes + 1];
+  crowFrameToHex(frame, hexValue);
+  Serial.println(hexValue);
+
+  if (debugalarme) {
+    mqttPublish(bus.debugTopic, hexValue, false, crowPriorityLow);
+  }
+
+  if (primary) {
+    uint32_t startCycles = ESP.getCycleCount();
+    recorder.recordFrame(frame, millis());
+    recordCycles.record(ESP.getCycleCount() - startCycles);
   }
 
-  if (boundaryAge > bufferSize) {
-    insideState = 0;
-    boundaryAge = -1;
+  if (!frameRegistry.dispatch(bus, frame)) {
+    bus.unknownFrames++;
+    bus.lastUnknownHeader = frame.length > 2 ? frame.bytes[1] : -1;
   }
 }
 
-// Function to send a packet to the alarm system
-void sendPacket(const byte* binaryData, size_t dataSize) {
-  // Stop receiving
-  //detachInterrupt(digitalPinToInterrupt(clockPin));
-  // Ensure dataPin is set as an output
-  while (!cansend) {
-    delayMicroseconds(100);
-    yield();
+void publishZones(AlarmBus& bus, uint16_t zones, const char* suffix, uint8_t priority) {
+  for (int zone = 0; zone < 16; zone++) {
+    if (zones & (1u << zone)) {
+      char message[20];
+      snprintf(message, sizeof(message), "%d %s", zone + 1, suffix);
+      mqttPublish(bus.activeZonesTopic, message, false, priority);
+      Serial.println(message);
+      bus.statusZonePublishes++;
+    }
   }
-  pinMode(dataPin, OUTPUT);
+}
 
-  for (size_t i = 0; i < dataSize; i++) {
-    byte currentByte = binaryData[i];
+// Append the zone numbers in the bitmap as a JSON array
+char* appendZoneList(char* out, const char* end, uint16_t zones) {
+  out += snprintf(out, end - out, "[");
+  bool first = true;
+  for (int zone = 0; zone < 16 && out < end; zone++) {
+    if (zones & (1u << zone)) {
+      out += snprintf(out, end - out, first ? "%d" : ",%d", zone + 1);
+      first = false;
+    }
+  }
+  if (out < end) {
+    out += snprintf(out, end - out, "]");
+  }
+  return out;
+}
 
-    for (int bit = 7; bit >= 0; bit--) {
-      // Wait for the clock to be low
-      while (digitalRead(clockPin) != LOW) {
-        delayMicroseconds(10);
-      }
+// Publish what changed in the status and zones of a bus since the last publish
+void processBusEvents(AlarmBus& bus) {
+  CrowPublishPlan plan;
+  if (!bus.eventFilter.poll(millis(), plan)) {
+    return;
+  }
+  if (plan.status) {
+    Serial.println(crowStatusName(plan.statusValue));
+    publishStatus(bus, plan.statusValue);
+    bus.statusZonePublishes++;
+  }
+  if (plan.zones && (bus.binaryTopics & binaryZones)) {
+    mqttPublishEvent(bus, bus.zonesTopic, bus.status, crowEventFlagZones, plan.activeZones, plan.triggeredZones,
+                     true, crowPriorityHigh);
+    bus.statusZonePublishes++;
+  } else if (plan.zones) {
+    char message[128];
+    char* end = message + sizeof(message);
+    char* out = message + snprintf(message, sizeof(message), "{\"active\":");
+    out = appendZoneList(out, end, plan.activeZones);
+    if (out < end) {
+      out += snprintf(out, end - out, ",\"triggered\":");
+    }
+    out = appendZoneList(out, end, plan.triggeredZones);
+    if (out < end) {
+      snprintf(out, end - out, "}");
+    }
+    mqttPublish(bus.zonesTopic, message, true, crowPriorityHigh);
+    bus.statusZonePublishes++;
+  }
+  if (bus.binaryTopics & binaryActiveZones) {
+    // All the announced zones in one message
+    if (plan.announceActive != 0 || plan.announceTriggered != 0) {
+      mqttPublishEvent(bus, bus.activeZonesTopic, bus.status, crowEventFlagAnnounce, plan.announceActive,
+                       plan.announceTriggered, false, plan.announceTriggered != 0 ? crowPriorityHigh : crowPriorityNormal);
+      bus.statusZonePublishes++;
+    }
+    return;
+  }
+  publishZones(bus, plan.announceActive, "activo", crowPriorityNormal);
+  publishZones(bus, plan.announceTriggered, "triggered", crowPriorityHigh);
+}
 
-      // Set the data line (dataPin) to the current bit value
-      digitalWrite(dataPin, (currentByte >> bit) & 1);
+void processEvents() {
+  for (AlarmBus& bus : buses) {
+    processBusEvents(bus);
+  }
+}
+
+// Clock ISR work for one bus, inlined into the ISR of each bus so the
+// receiver's pins are constants there. The capture path is all in IRAM, so
+// it keeps running during an OTA update, also while the image is being
+// written to the flash; see serviceDuringOta().
+template <typename Receiver>
+CROW_ALWAYS_INLINE void onBusClock(Receiver& bus) {
+  uint32_t startCycles = ESP.getCycleCount();
+  bus.onClockEdge(startCycles);
+  bus.isrCycles.record(ESP.getCycleCount() - startCycles);
+}
+
+void IRAM_ATTR clockCallback() {
+  onBusClock(receiver);
+}
+
+#if SECOND_BUS
+void IRAM_ATTR clockCallback2() {
+  onBusClock(receiver2);
+}
+#endif
+
+// Send the capture batch when it is due. Nothing here waits: a batch that
+// cannot go out right away is dropped and its frames counted as lost.
+void processCapture() {
+  if (captureMode == captureTcp && captureServer.hasClient()) {
+    // A new receiver replaces the previous one
+    captureClient.stop();
+    captureClient = captureServer.accept();
+  }
+  if (captureMode == captureOff || !capture.due(millis())) {
+    return;
+  }
+  const uint8_t* batch = capture.data();
+  size_t length = capture.length();
+  bool ok;
+  if (captureMode == captureMqtt) {
+    ok = client.publish(captureTopic, batch, length);
+  } else {
+    ok = captureClient.connected() && captureClient.availableForWrite() >= (int)length &&
+         captureClient.write(batch, length) == length;
+  }
+  capture.sent(ok, buses[0].port.rxOverflows);
+}
 
-      // Wait for the clock to go high
-      while (digitalRead(clockPin) != HIGH) {
-        delayMicroseconds(10);
+// Drain the bytes captured by the clock ISRs into the decoders
+void processBusBits() {
+  for (AlarmBus& bus : buses) {
+    uint16_t backlog = bus.port.rxRing.size();
+    if (backlog > bus.rxBacklogMax) {
+      bus.rxBacklogMax = backlog;
+    }
+    uint8_t captured;
+    while (bus.port.rxRing.pop(captured)) {
+      uint32_t startCycles = ESP.getCycleCount();
+      for (int bit = 7; bit >= 0; bit--) {
+        bus.deframer.pushBit((captured >> bit) & 1);
+      }
+      bus.deframeCycles.record(ESP.getCycleCount() - startCycles);
+      while (const CrowFrame* frame = bus.deframer.peekFrame()) {
+        printBuffer(bus, *frame);
+        bus.deframer.popFrame();
       }
     }
   }
+}
+
+// Queue a keypad button press; the clock ISR sends it when the bus is idle.
+// backToBack keys go out in the next idle window without the txGapMs pause.
+void queueKeypress(AlarmBus& bus, int key, bool backToBack = false) {
+  byte packet[crowKeypressPacketLength];
+  crowEncodeKeypress(key, packet);
+  if (!bus.port.transmitter.queuePacket(packet, crowKeypressPacketLength, ESP.getCycleCount(), backToBack)) {
+    Serial.println("Keypress queue full");
+  }
+}
+
+void publishCommandResult(AlarmBus& bus, CrowCommandOutcome outcome) {
+  CrowCommandPipeline& commandPipeline = bus.commandPipeline;
+  char message[48];
+  switch (outcome) {
+    case crowCommandOk:
+      snprintf(message, sizeof(message), "%s ok %lums", commandPipeline.name(), (unsigned long)commandPipeline.latencyMs());
+      break;
+    case crowCommandRetry:
+      snprintf(message, sizeof(message), "%s retry %u", commandPipeline.name(), commandPipeline.attempt());
+      break;
+    case crowCommandFailed:
+      snprintf(message, sizeof(message), "%s failed", commandPipeline.name());
+      break;
+    case crowCommandCancelled:
+      snprintf(message, sizeof(message), "%s cancelled", commandPipeline.name());
+      break;
+    default:
+      return;
+  }
+  if (&bus == &buses[0]) {
+    recorder.recordCommand(commandPipeline.name(), outcome, commandPipeline.attempt(), millis());
+  }
+  mqttPublish(bus.resultTopic, message, false, crowPriorityHigh);
+  Serial.println(message);
+}
 
-  // Wait for the clock to be low before ending transmission
-  while (digitalRead(clockPin) != LOW) {
-    delayMicroseconds(10);
+// Start a keypress sequence that should take the panel to the target status,
+// going through the ackStatuses (bitmask) on the way
+void startCommand(AlarmBus& bus, const char* name, const uint8_t* keys, uint8_t count, uint8_t target,
+                  uint8_t ackStatuses) {
+  if (bus.commandPipeline.active()) {
+    bus.commandPipeline.cancel(millis());
+    publishCommandResult(bus, bus.commandPipeline.poll(millis()));
   }
+  bus.commandPipeline.start(name, keys, count, target, ackStatuses, millis());
+}
 
-  // Send a final 0
-  digitalWrite(dataPin, LOW);
+// Hand pending sequences to the transmitters and report their outcome
+void processCommands() {
+  for (AlarmBus& bus : buses) {
+    const uint8_t* keys;
+    uint8_t count;
+    if (bus.commandPipeline.takeKeys(keys, count)) {
+      for (uint8_t i = 0; i < count; i++) {
+        queueKeypress(bus, keys[i], i > 0);
+      }
+    }
+    if (bus.commandPipeline.waitingForTransmit() && !bus.port.transmitter.busy()) {
+      bus.commandPipeline.keysSent(millis());
+    }
+    publishCommandResult(bus, bus.commandPipeline.poll(millis()));
+  }
+}
+
+// Relay actions are only accepted in the first bus's rules, the relays are
+// wired to that panel
+uint8_t ruleRelayCount(const AlarmBus& bus) {
+  return &bus == &buses[0] ? relayCount : 0;
+}
 
-  // Wait for the clock to go high
-  while (digitalRead(clockPin) != HIGH) {
-    delayMicroseconds(10);
+// Rule actions run straight from the decoder, without waiting for the broker
+void runRuleAction(CrowRuleEngine& engine, uint8_t index, const CrowRule& rule) {
+  for (AlarmBus& bus : buses) {
+    if (&bus.rules != &engine) {
+      continue;
+    }
+    char message[40];
+    if (rule.action == crowRuleKeys) {
+      for (uint8_t i = 0; i < rule.keyCount; i++) {
+        queueKeypress(bus, rule.keys[i], i > 0);
+      }
+      snprintf(message, sizeof(message), "Regra %u executada", index + 1);
+    } else if (relayAvailable[rule.relay] && relays.queue(rule.relay, rule.pulse)) {
+      snprintf(message, sizeof(message), "Regra %u executada: %s", index + 1, relayCommands[rule.relay]);
+    } else {
+      snprintf(message, sizeof(message), "Regra %u: rele indisponivel", index + 1);
+    }
+    mqttPublish(bus.logTopic, message);
   }
+}
 
-  while (digitalRead(clockPin) != LOW) {
-    delayMicroseconds(10);
+// New rules from the rules topic: run and stored if they all parse, otherwise
+// the current ones stay
+void updateRules(AlarmBus& bus, const char* text, unsigned int length) {
+  char message[48];
+  uint16_t errorLine;
+  if (length > crowRulesTextBytes) {
+    snprintf(message, sizeof(message), "Regras: texto demasiado longo");
+  } else if (!bus.rules.load(text, length, relayCommands, ruleRelayCount(bus), errorLine)) {
+    snprintf(message, sizeof(message), "Regras: erro na linha %u", errorLine);
+  } else if (!crowSaveRules(bus.rulesFlash, text, length)) {
+    snprintf(message, sizeof(message), "Regras: %u carregadas, erro ao gravar", bus.rules.size());
+  } else {
+    snprintf(message, sizeof(message), "Regras: %u carregadas", bus.rules.size());
   }
+  Serial.println(message);
+  mqttPublish(bus.logTopic, message);
+}
 
-  // Ensure data line stays high
-  digitalWrite(dataPin, HIGH);
+// Handlers for the payloads accepted on the control topic of each bus. bus is
+// the one whose topic the command came on, arg the value from the table
+// entry, args whatever followed the keyword and its separator.
+void controlRelay(AlarmBus& bus, uint8_t relay, const char* args) {
+  CrowPulsePattern pulse;
+  // The relays are wired to the first panel's keyswitch input
+  if (&bus != &buses[0] || !relayAvailable[relay] || !crowParsePulseOptions(args, pulse)) {
+    return;
+  }
+  mqttPublish(bus.logTopic, relayLogMessages[relay]);
+  if (!relays.queue(relay, pulse)) {
+    mqttPublish(bus.logTopic, "Fila do rele cheia");
+  }
+}
 
-  // Wait for the clock to go high
-  while (digitalRead(clockPin) != HIGH) {
-    delayMicroseconds(10);
+void controlParcial(AlarmBus& bus, uint8_t, const char*) {
+  mqttPublish(bus.logTopic, "Activada Guarda Parcial");
+  const uint8_t keys[] = {crowKeyEnter, crowKeyParcial}; //Send "enter" at the beggining to "wake up the system"
+  startCommand(bus, "parcial", keys, sizeof(keys), crowArmedPartial, 1 << crowArmingPartial);
+}
+
+void controlTotal(AlarmBus& bus, uint8_t, const char*) {
+  mqttPublish(bus.logTopic, "Activada Guarda Total");
+  const uint8_t keys[] = {crowKeyEnter, crowKeyTotal}; //Send "enter" at the beggining to "wake up the system"
+  startCommand(bus, "total", keys, sizeof(keys), crowArmedTotal, 1 << crowArmingTotal);
+}
+
+void controlAlarme(AlarmBus& bus, uint8_t, const char*) {
+  mqttPublish(bus.logTopic, "Alarme despoletado activamente");
+  const uint8_t keys[] = {crowKeyEnter, crowKeyPanic}; //Send "enter" at the beggining to "wake up the system"
+  startCommand(bus, "alarme", keys, sizeof(keys), crowTriggered, 0);
+}
+
+void controlActualizar(AlarmBus& bus, uint8_t, const char*) {
+  mqttPublish(bus.logTopic, "Actualizar...");
+  queueKeypress(bus, 1);
+  queueKeypress(bus, crowKeyEnter);
+}
+
+void controlEnter(AlarmBus& bus, uint8_t, const char*) {
+  mqttPublish(bus.logTopic, "enter");
+  queueKeypress(bus, crowKeyEnter);
+}
+
+void controlOne(AlarmBus& bus, uint8_t, const char*) {
+  mqttPublish(bus.logTopic, "1");
+  queueKeypress(bus, 1);
+}
+
+//receive the code after "desarmar-" or "desarmar " and send it to the alarm to deactivate it
+void controlDesarmar(AlarmBus& bus, uint8_t, const char* code) {
+  uint8_t keys[crowMaxCommandKeys];
+  uint8_t count = 0;
+  keys[count++] = crowKeyEnter; //Send "enter" at the beggining to "wake up the system"
+  for (; *code != '\0' && count < crowMaxCommandKeys - 1; code++) {
+    if (isdigit(*code)) {
+      keys[count++] = *code - '0'; // Convert char to integer
+    }
   }
+  keys[count++] = crowKeyEnter; //Send "enter" at the end
+  startCommand(bus, "desarmar", keys, count, crowDisarmed, 0);
+  mqttPublish(bus.logTopic, "Desarmado");
+}
 
-  pinMode(dataPin, INPUT);
+// "capture" or "capture-mqtt", "capture-tcp" and "capture-off"
+void controlCapture(AlarmBus&, uint8_t, const char* mode) {
+  captureClient.stop();
+  if (strcmp(mode, "off") == 0) {
+    captureMode = captureOff;
+    mqttPublish(logTopic, "Captura off");
+    return;
+  }
+  bool tcp = strcmp(mode, "tcp") == 0;
+  if (!tcp && *mode != '\0' && strcmp(mode, "mqtt") != 0) {
+    return;
+  }
+  if (tcp) {
+    captureServer.begin();
+  }
+  capture.begin(ESP.getCpuFreqMHz());
+  captureMode = tcp ? captureTcp : captureMqtt;
+  mqttPublish(logTopic, tcp ? "Captura TCP on" : "Captura MQTT on");
+}
 
-  // Restart receiving
-  //attachInterrupt(digitalPinToInterrupt(clockPin), clockCallback, FALLING);
-  delay(50);
+// "binario:<topics>": comma separated status, zones and active_zones, "all"
+// or "off", get the binary event payload instead of text. Kept in EEPROM.
+void controlBinario(AlarmBus& bus, uint8_t, const char* args) {
+  uint8_t topics = 0;
+  if (strcmp(args, "all") == 0) {
+    topics = binaryAll;
+  } else if (strcmp(args, "off") != 0) {
+    while (*args != '\0') {
+      size_t length = strcspn(args, ",");
+      if (length == 6 && strncmp(args, "status", 6) == 0) {
+        topics |= binaryStatus;
+      } else if (length == 5 && strncmp(args, "zones", 5) == 0) {
+        topics |= binaryZones;
+      } else if (length == 12 && strncmp(args, "active_zones", 12) == 0) {
+        topics |= binaryActiveZones;
+      } else {
+        return;
+      }
+      args += length;
+      if (*args == ',') {
+        args++;
+      }
+    }
+  }
+  bus.binaryTopics = topics;
+  EEPROM.write(formatAddress + (&bus - buses), topics);
+  EEPROM.commit();
+  char message[40];
+  snprintf(message, sizeof(message), "Formato binario: %u", topics);
+  mqttPublish(bus.logTopic, message);
 }
 
-// Function to send keypad button presses
-void sendBinaryPacket(int decimalNumber) {
-  byte binaryArray[binarySizeBytes + 4];  // 8 bits + leading/trailing bytes
+// "glitchfilter:<us>", shortest clock period accepted, 0 disables the filter
+void controlGlitchFilter(AlarmBus& bus, uint8_t, const char* args) {
+  char* end;
+  unsigned long us = strtoul(args, &end, 10);
+  if (*args == '\0' || *end != '\0' || us > 1000) {
+    return;
+  }
+  bus.port.clockFilter.minTicks = ESP.getCpuFreqMHz() * us;
+  char message[40];
+  snprintf(message, sizeof(message), "Filtro de glitches %lu us", us);
+  mqttPublish(bus.logTopic, message);
+}
 
-  // Initialize the binary array
-  memset(binaryArray, 0, sizeof(binaryArray));
+// "glitchlevelon"/"glitchleveloff", also drop edges whose clock is already
+// high again when the ISR reads it
+void controlGlitchLevel(AlarmBus& bus, uint8_t on, const char*) {
+  bus.port.clockFilter.requireLow = on;
+  mqttPublish(bus.logTopic, on ? "Filtro de nivel on" : "Filtro de nivel off");
+}
 
-  // Add leading bytes
-  binaryArray[0] = 0b01111110;
-  binaryArray[1] = 0b10000101;
-  binaryArray[2] = 0b00000000;
+void controlDebug(AlarmBus&, uint8_t on, const char*) {
+  mqttPublish(logTopic, on ? "Debug on!" : "Debug off!");
+  Serial.println(on ? "Debug on!" : "Debug off!");
+  debugalarme = on;
+  if (!on) {
+    zonedata = false;
+  }
+}
 
-  // Convert decimal to binary and reverse the bits
-  for (int i = 0; i < 8; i++) {
-    binaryArray[3] |= ((decimalNumber & 1) ? 1 : 0) << (7 - i);
-    decimalNumber >>= 1;
+void controlZoneData(AlarmBus&, uint8_t on, const char*) {
+  mqttPublish(logTopic, on ? "Dados da zona on!" : "Dados da zona off!");
+  Serial.println(on ? "Dados da zona on!" : "Dados da zona off!");
+  zonedata = on;
+}
+
+// Publish the flight recorder to recorderTopic, one binary message per chunk
+void controlRecorder(AlarmBus&, uint8_t, const char*) {
+  static uint8_t chunk[crowRecorderChunkBytes];
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < recorder.chunkCount(); i++) {
+    size_t length = recorder.writeChunk(i, now, chunk);
+    client.publish(recorderTopic, chunk, length);
   }
+}
 
-  // Add trailing byte
-  binaryArray[4] = 0b01111110;  // Trailing byte
+void controlRestart(AlarmBus&, uint8_t, const char*) {
+  mqttPublish(logTopic, "A reiniciar...");
+  Serial.println("Restart..");
+  recorder.snapshot(millis());
+  delay(1000);
+  ESP.restart();
+}
 
-  // Send the constructed binary data
-  sendPacket(binaryArray, binarySizeBytes + 4);
+struct ControlCommand {
+  const char* keyword;
+  void (*handler)(AlarmBus& bus, uint8_t arg, const char* args);
+  uint8_t arg;
+  bool takesArgs;  // "<keyword>-<args>", "<keyword> <args>" or "<keyword>:<args>"
+};
+
+// Sorted by keyword, looked up with a binary search
+constexpr ControlCommand controlCommands[] = {
+  {"1", controlOne, 0, false},
+  {"actualizar", controlActualizar, 0, false},
+  {"alarme", controlAlarme, 0, false},
+  {"alarmepin", controlRelay, 2, true},
+  {"binario", controlBinario, 0, true},
+  {"capture", controlCapture, 0, true},
+  {"debugoff", controlDebug, false, false},
+  {"debugon", controlDebug, true, false},
+  {"desarmar", controlDesarmar, 0, true},
+  {"enter", controlEnter, 0, false},
+  {"glitchfilter", controlGlitchFilter, 0, true},
+  {"glitchleveloff", controlGlitchLevel, false, false},
+  {"glitchlevelon", controlGlitchLevel, true, false},
+  {"parcial", controlParcial, 0, false},
+  {"parcialpin", controlRelay, 0, true},
+  {"recorder", controlRecorder, 0, false},
+  {"restart", controlRestart, 0, false},
+  {"total", controlTotal, 0, false},
+  {"totalpin", controlRelay, 1, true},
+  {"zonedataoff", controlZoneData, false, false},
+  {"zonedataon", controlZoneData, true, false},
+};
+static_assert(crowKeywordsSorted(controlCommands), "controlCommands must be sorted by keyword");
+
+const uint8_t maxControlArgs = 24;
+uint32_t controlHeapDeltaMax = 0; // worst heap lost while handling a command, should stay 0
+uint32_t minFreeHeap = UINT32_MAX; // lowest free heap seen by loop()
+
+// Parse a control payload in place, without copying it into a String
+void dispatchControl(AlarmBus& bus, const char* payload, unsigned int length) {
+  while (length > 0 && isspace(payload[0])) {
+    payload++;
+    length--;
+  }
+  while (length > 0 && isspace(payload[length - 1])) {
+    length--;
+  }
+  unsigned int keywordLength = 0;
+  while (keywordLength < length && strchr("- :", payload[keywordLength]) == nullptr) {
+    keywordLength++;
+  }
+  const ControlCommand* command = crowFindKeyword(controlCommands, payload, keywordLength);
+  if (command == nullptr) {
+    return;
+  }
+  char args[maxControlArgs + 1];
+  unsigned int argsLength = keywordLength < length ? length - keywordLength - 1 : 0;
+  if ((argsLength > 0 && !command->takesArgs) || argsLength > maxControlArgs) {
+    return;
+  }
+  // Handlers publish, which reuses the PubSubClient buffer the payload lives
+  // in, so the arguments are copied out first
+  memcpy(args, payload + length - argsLength, argsLength);
+  args[argsLength] = '\0';
+  command->handler(bus, command->arg, args);
 }
 
 void callback(char* topic, byte* payload, unsigned int length) {
-  // Check if OTA update is in progress, and disable the interrupt if it is
+  // No commands or rule changes while an OTA update is being written
   if (otaInProgress) {
     return;
   }
-  payload[length] = '\0';
-  String receivedPayload = String((char*)payload);
-  
-  if (strcmp(topic, mqttControlTopic) == 0) {
-    if (receivedPayload == "parcialpin") {
-      client.publish(logTopic, "Activado Keyswitch da Guarda Parcial");
-      activatePin(parcialPin, 1000);
-    } else if (receivedPayload == "totalpin") {
-      client.publish(logTopic, "Activado Keyswitch da Guarda Total");
-      activatePin(totalPin, 1000);
-    } else if (receivedPayload == "alarmepin") {
-      client.publish(logTopic, "Alarme despoletado activamente");
-      activatePin(alarmePin, 1000);
-    } else if (receivedPayload == "parcial") {
-      client.publish(logTopic, "Activada Guarda Parcial");
-      sendBinaryPacket(17); //Send "enter" at the beggining to "wake up the system"
-      sendBinaryPacket(14);
-    } else if (receivedPayload == "total") {
-      client.publish(logTopic, "Activada Guarda Total");
-      sendBinaryPacket(17); //Send "enter" at the beggining to "wake up the system"
-      sendBinaryPacket(13);
-    } else if (receivedPayload == "alarme") {
-      client.publish(logTopic, "Alarme despoletado activamente");
-      sendBinaryPacket(17); //Send "enter" at the beggining to "wake up the system"
-      sendBinaryPacket(32);
-    } else if (receivedPayload == "actualizar") {
-      client.publish(logTopic, "Actualizar...");
-      sendBinaryPacket(1);
-      sendBinaryPacket(17);
-    } else if (receivedPayload == "enter") {
-      client.publish(logTopic, "enter");
-      sendBinaryPacket(17);
-    } else if (receivedPayload == "1") {
-      client.publish(logTopic, "1");
-      sendBinaryPacket(1);
-    //receive the code after "desarmar-" or "desarmar " and send it to the alarm to deactivate it
-    } else if (receivedPayload.startsWith("desarmar-") || receivedPayload.startsWith("desarmar ")) {
-      sendBinaryPacket(17); //Send "enter" at the beggining to "wake up the system"
-      String digits = receivedPayload.substring(9); // Get the digits after "desarmar-"
-      for (size_t i = 0; i < digits.length(); i++) {
-        char digitChar = digits.charAt(i);
-        if (isdigit(digitChar)) {
-          int digit = digitChar - '0'; // Convert char to integer
-          sendBinaryPacket(digit);
-        }
+  // topic and payload point into PubSubClient's buffer, which the handlers'
+  // publishes write over: work on copies. Subscribed topics fit in
+  // busTopicBytes.
+  char received[busTopicBytes];
+  if (strlen(topic) >= sizeof(received)) {
+    return;
+  }
+  strcpy(received, topic);
+  static char text[crowRulesTextBytes + 1];
+  unsigned int copied = length < sizeof(text) ? length : sizeof(text) - 1;
+  memcpy(text, payload, copied);
+  text[copied] = '\0';
+  for (AlarmBus& bus : buses) {
+    if (strcmp(received, bus.rulesTopic) == 0) {
+      // Too long to copy is also too long to store, updateRules() says so
+      updateRules(bus, text, length);
+      return;
+    }
+    if (strcmp(received, bus.controlTopic) == 0) {
+      if (copied < length) {
+        return;
       }
-      sendBinaryPacket(17); //Send "enter" at the end
-      client.publish(logTopic, "Desarmado");
-    } else if (receivedPayload == "debugon") {
-      client.publish(logTopic, "Debug on!");
-      Serial.println("Debug on!");
-      debugalarme = true;
-    } else if (receivedPayload == "debugoff") {
-      client.publish(logTopic, "Debug off!");
-      Serial.println("Debug off!");
-      debugalarme = false;
-      zonedata = false;
-    } else if (receivedPayload == "zonedataon") {
-      client.publish(logTopic, "Dados da zona on!");
-      Serial.println("Dados da zona on!");
-      zonedata = true;
-    } else if (receivedPayload == "zonedataoff") {
-      client.publish(logTopic, "Dados da zona off!");
-      Serial.println("Dados da zona off!");
-      zonedata = false;
-    } else if (receivedPayload == "restart") {
-      client.publish(logTopic, "A reiniciar...");
-      Serial.println("Restart..");
-      delay(1000);
-      ESP.restart();
+      uint32_t heapBefore = ESP.getFreeHeap();
+      dispatchControl(bus, text, length);
+      uint32_t heapAfter = ESP.getFreeHeap();
+      if (heapAfter < heapBefore && heapBefore - heapAfter > controlHeapDeltaMax) {
+        controlHeapDeltaMax = heapBefore - heapAfter;
+      }
+      return;
     }
   }
 }
 
+template <typename Histogram>
+void addHistogram(JsonArray buckets, const Histogram& histogram) {
+  for (uint8_t i = 0; i < Histogram::buckets(); i++) {
+    buckets.add(histogram.count(i));
+  }
+}
+
+// Counters of one bus: capture health, keypresses, commands, publishes and
+// its status journal
+template <typename Document>
+void addBusTelemetry(Document& jsonDoc, AlarmBus& bus) {
+  CrowBusPort& port = bus.port;
+  jsonDoc["BusClockHz"] = bus.busClockRate.update(port.busEdges, millis());
+  jsonDoc["Frames"] = bus.deframer.framesOk;
+  jsonDoc["FramesMisaligned"] = bus.deframer.framesMisaligned;
+  jsonDoc["FramesOverlong"] = bus.deframer.framesOverlong;
+  jsonDoc["FramesAborted"] = bus.deframer.framesAborted;
+  jsonDoc["FramesDropped"] = bus.deframer.framesDropped;
+  jsonDoc["RxOverflow"] = port.rxOverflows;
+  jsonDoc["RxBacklogMax"] = bus.rxBacklogMax;
+  jsonDoc["Glitches"] = port.clockFilter.glitches;
+  uint32_t edgeMin = port.clockFilter.minInterval;
+  jsonDoc["EdgeMinUs"] = edgeMin == UINT32_MAX ? 0 : edgeMin / ESP.getCpuFreqMHz();
+  jsonDoc["IsrMaxCycles"] = port.isrCycles.max();
+  addHistogram(jsonDoc.createNestedArray("IsrHist"), port.isrCycles);
+  jsonDoc["DeframeMaxCycles"] = bus.deframeCycles.max();
+  addHistogram(jsonDoc.createNestedArray("DeframeHist"), bus.deframeCycles);
+  jsonDoc["DecodeMaxCycles"] = bus.decodeCycles.max();
+  addHistogram(jsonDoc.createNestedArray("DecodeHist"), bus.decodeCycles);
+  jsonDoc["CacheHits"] = bus.frameCache.hits;
+  jsonDoc["CacheMisses"] = bus.frameCache.misses;
+  jsonDoc["KeypressFrames"] = bus.keypressFrames;
+  jsonDoc["UnknownFrames"] = bus.unknownFrames;
+  jsonDoc["UnknownHeader"] = bus.lastUnknownHeader;
+  // Keypress transmit queue
+  const CrowTransmitter& transmitter = port.transmitter;
+  uint32_t cyclesPerMs = ESP.getCpuFreqMHz() * 1000UL;
+  jsonDoc["TxQueue"] = transmitter.queued();
+  jsonDoc["TxQueueMax"] = transmitter.queueMax;
+  jsonDoc["TxSent"] = transmitter.packetsSent;
+  jsonDoc["TxDropped"] = transmitter.packetsDropped;
+  jsonDoc["TxLatencyMs"] = transmitter.lastLatency / cyclesPerMs;
+  jsonDoc["TxLatencyMaxMs"] = transmitter.maxLatency / cyclesPerMs;
+  // Arm/disarm commands
+  jsonDoc["CmdOk"] = bus.commandPipeline.commandsOk;
+  jsonDoc["CmdFailed"] = bus.commandPipeline.commandsFailed;
+  jsonDoc["CmdRetries"] = bus.commandPipeline.retries;
+  jsonDoc["CmdLatencyMs"] = bus.commandPipeline.latencyMs();
+  jsonDoc["CmdLatencyMaxMs"] = bus.commandPipeline.maxLatencyMs;
+  // Status/zone publishes, and how many publishing every frame would have taken
+  jsonDoc["PubSent"] = bus.statusZonePublishes;
+  jsonDoc["PubUnfiltered"] = bus.eventFilter.unfilteredPublishes;
+  // Status journal
+  jsonDoc["JournalWrites"] = bus.statusJournal.writes;
+  jsonDoc["JournalErases"] = bus.statusJournal.erases;
+  jsonDoc["JournalErrors"] = bus.statusJournal.writeErrors;
+  jsonDoc["StatusStore"] = bus.statusJournal.active() ? "journal" : statusInEeprom(bus) ? "eeprom" : "none";
+}
+
+// Telemetry documents are serialized into one buffer shared by the tele
+// topics, grown to what measureJson() says they take, and the MQTT buffer is
+// grown along with it, so a large counter never truncates the JSON.
+char* jsonBuffer = nullptr;
+size_t jsonBufferSize = 0;
+
+// Telemetry comes last: it is skipped while anything else is still waiting
+// in the outbox.
+template <typename Document>
+void publishJson(const char* topic, const Document& jsonDoc) {
+  if (outbox.size() != 0) {
+    return;
+  }
+  size_t length = measureJson(jsonDoc);
+  if (length + 1 > jsonBufferSize) {
+    size_t size = (length + 1 + 127) & ~(size_t)127;
+    char* grown = (char*)realloc(jsonBuffer, size);
+    if (grown == nullptr) {
+      Serial.printf("Sem memoria para %u bytes de telemetria\n", (unsigned)size);
+      return;
+    }
+    jsonBuffer = grown;
+    jsonBufferSize = size;
+  }
+  serializeJson(jsonDoc, jsonBuffer, jsonBufferSize);
+  size_t packet = mqttHeaderBytes + strlen(topic) + length;
+  if (packet > client.getBufferSize() && !client.setBufferSize(packet)) {
+    Serial.printf("Sem memoria para %u bytes de MQTT\n", (unsigned)packet);
+    return;
+  }
+  client.publish(topic, jsonBuffer);
+}
+
+// The second bus's counters, on its own tele topic
+void publishBusTelemetry(AlarmBus& bus) {
+  static StaticJsonDocument<1152> jsonDoc;
+  jsonDoc.clear();
+  addBusTelemetry(jsonDoc, bus);
+  publishJson(bus.teleTopic, jsonDoc);
+}
+
+// Rule stats, as "<rule number>": [evaluations, fired, average cycles, max cycles]
+const size_t ruleNameBytes = 4;  // a rule number and its terminator, copied into the document
+static_assert(crowMaxRules < 1000, "rule numbers must fit in ruleNameBytes");
+const size_t ruleTelemetryBytes = JSON_OBJECT_SIZE(crowMaxRules) + crowMaxRules * (JSON_ARRAY_SIZE(4) + ruleNameBytes);
+
+void publishRuleTelemetry(AlarmBus& bus) {
+  static StaticJsonDocument<ruleTelemetryBytes> jsonDoc;
+  jsonDoc.clear();
+  for (uint8_t i = 0; i < bus.rules.size(); i++) {
+    const CrowRuleStats& rule = bus.rules.ruleStats(i);
+    char name[ruleNameBytes];
+    snprintf(name, sizeof(name), "%u", i + 1);
+    JsonArray values = jsonDoc.createNestedArray(name);
+    values.add(rule.evaluations);
+    values.add(rule.fired);
+    values.add(rule.averageCycles());
+    values.add(rule.maxCycles);
+  }
+  publishJson(bus.teleRulesTopic, jsonDoc);
+}
+
+// send tele values
+void publishTelemetry() {
+  // Calculate uptime in milliseconds
+  unsigned long uptimeMillis = millis() - startupTime;
+  // Convert milliseconds to HH:MM:SS format
+  unsigned long seconds = uptimeMillis / 1000;
+  unsigned long minutes = seconds / 60;
+  unsigned long hours = minutes / 60;
+  unsigned long days = hours / 24; // Calculate days
+  seconds %= 60;
+  minutes %= 60;
+  hours %= 24; // Ensure hours don't exceed 24
+
+  // Create a formatted string in DDd HH:MM:SS format
+  char uptimeStr[20]; // Format: DDd HH:MM:SS\0
+  sprintf(uptimeStr, "%luD %02lu:%02lu:%02lu", days, hours, minutes, seconds);
+  // Create a JSON object; static, it is too big for the stack
+  static StaticJsonDocument<1792> jsonDoc;
+  jsonDoc.clear();
+  // Add the uptime, RSSI and IP values to the JSON object
+  IPAddress ip = WiFi.localIP();
+  char ipStr[16];
+  snprintf(ipStr, sizeof(ipStr), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+  jsonDoc["Uptime"] = uptimeStr;
+  jsonDoc["IP"] = ipStr;
+  jsonDoc["RSSI"] = WiFi.RSSI();
+  // First bus
+  addBusTelemetry(jsonDoc, buses[0]);
+  jsonDoc["RecordMaxCycles"] = recordCycles.max();
+
+  // Heap, to check nothing is leaking or fragmenting it over time
+  jsonDoc["FreeHeap"] = ESP.getFreeHeap();
+  jsonDoc["FreeHeapMin"] = minFreeHeap;
+  jsonDoc["MaxFreeBlock"] = ESP.getMaxFreeBlockSize();
+  jsonDoc["HeapFrag"] = ESP.getHeapFragmentation();
+  jsonDoc["CmdHeapDeltaMax"] = controlHeapDeltaMax;
+  // MQTT outbox
+  jsonDoc["OutboxQueued"] = outbox.size();
+  jsonDoc["OutboxMax"] = outbox.maxSize;
+  jsonDoc["OutboxDropped"] = outbox.dropped;
+  jsonDoc["MqttConnects"] = mqttConnects;
+  // Wi-Fi connections: time the last one took, and fast connects against fallbacks to a scan
+  jsonDoc["WifiConnectMs"] = wifiConnectMs;
+  jsonDoc["WifiAttempts"] = wifiAttempts;
+  jsonDoc["WifiConnects"] = wifiConnects;
+  jsonDoc["WifiFastConnects"] = wifiFastConnects;
+  jsonDoc["WifiFallbacks"] = wifiFallbacks;
+  // Raw capture
+  jsonDoc["CaptureFrames"] = capture.framesCaptured;
+  jsonDoc["CaptureLost"] = capture.framesLost;
+  // Flight recorder
+  jsonDoc["Recorded"] = recorder.recorded;
+  jsonDoc["RecorderSnapshots"] = recorder.snapshots;
+
+  // Publish the JSON string to the MQTT teleTopic
+  publishJson(teleTopic, jsonDoc);
+}
+
+uint32_t clockMicros() {
+  return micros();
+}
+
+bool busBitsPending() {
+  for (AlarmBus& bus : buses) {
+    if (!bus.port.rxRing.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void trackHeap() {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < minFreeHeap) {
+    minFreeHeap = freeHeap;
+  }
+}
+
+void serviceJournal() {
+  for (AlarmBus& bus : buses) {
+    bus.statusJournal.service(millis());
+  }
+}
+
+void serviceRecorder() {
+  recorder.service(millis());
+}
+
+void serviceMqtt() {
+  client.loop();
+  flushOutbox();
+}
+
+void feedWatchdog() {
+  ESP.wdtFeed();
+}
+
+void serviceOta() {
+  if (otaStarted) {
+    ArduinoOTA.handle();
+  }
+}
+
+uint32_t busOverflows() {
+  uint32_t overflows = 0;
+  for (AlarmBus& bus : buses) {
+    overflows += bus.port.rxOverflows;
+  }
+  return overflows;
+}
+
+// ArduinoOTA stays in handle() until the whole image is received and
+// written, so loop() does not run meanwhile. It calls this after each chunk
+// (onProgress): the bytes the ISRs captured meanwhile are decoded, and
+// status changes, zones and command results still go out. Only the tasks
+// that keep the panel monitored and MQTT alive run here, not the ones that
+// write to the flash or reconnect; a status change that goes to EEPROM waits
+// for the end of the update (saveStatus()), and callback() drops commands
+// and rule changes meanwhile.
+void serviceDuringOta() {
+  uint32_t now = millis();
+  if (now - otaServicedMs > otaBlindMs) {
+    otaBlindMs = now - otaServicedMs;
+  }
+  processBusBits();
+  processEvents();
+  processCommands();
+  processRelays();
+  serviceMqtt();
+  feedWatchdog();
+  otaServicedMs = millis();
+}
+
+// Report how the OTA update went on logTopic; result is "concluido" or the error
+void reportOta(const char* result) {
+  serviceDuringOta();
+  char message[128];
+  snprintf(message, sizeof(message), "OTA %s: %lu ms, janela cega maxima %lu ms, %lu bytes perdidos no barramento",
+           result, (unsigned long)(millis() - otaStartMs), (unsigned long)otaBlindMs,
+           (unsigned long)(busOverflows() - otaStartOverflows));
+  Serial.println(message);
+  mqttPublish(logTopic, message, false, crowPriorityHigh);
+  flushOutbox();
+}
+
+void serviceTelemetry();
+
+// Everything loop() does, in the order it runs on each pass: name, function,
+// period (0 for every pass), trigger, and the run time in us above which the
+// task is reported as overrunning
+constexpr CrowTask loopTasks[] = {
+  {"heap", trackHeap, 0, nullptr, 0},
+  {"bus", processBusBits, 0, busBitsPending, 2000},
+  {"capture", processCapture, 0, nullptr, 10000},
+  {"events", processEvents, 0, nullptr, 20000},
+  {"commands", processCommands, 0, nullptr, 10000},
+  {"relays", processRelays, 0, nullptr, 2000},
+  {"journal", serviceJournal, 0, nullptr, 100000},     // a sector erase takes tens of ms
+  {"recorder", serviceRecorder, 0, nullptr, 200000},
+  {"network", processNetwork, 0, nullptr, 100000},     // a failed MQTT connect takes seconds
+  {"mqtt", serviceMqtt, 0, nullptr, 50000},
+  {"watchdog", feedWatchdog, interval, nullptr, 0},
+  {"telemetry", serviceTelemetry, intervaltele, nullptr, 50000},
+  {"ota", serviceOta, 0, nullptr, 50000},
+};
+CrowScheduler<sizeof(loopTasks) / sizeof(loopTasks[0])> scheduler(loopTasks, clockMicros);
+
+// loop() task stats, as "<task>": [average us, max us, max latency us, overruns]
+void publishTaskTelemetry() {
+  static StaticJsonDocument<1280> jsonDoc;
+  jsonDoc.clear();
+  jsonDoc["Passes"] = scheduler.passes;
+  jsonDoc["PassMaxUs"] = scheduler.passMaxUs;
+  for (size_t i = 0; i < scheduler.size(); i++) {
+    const CrowTaskStats& task = scheduler.taskStats(i);
+    JsonArray values = jsonDoc.createNestedArray(scheduler.task(i).name);
+    values.add(task.averageUs());
+    values.add(task.maxUs);
+    values.add(task.maxLatencyUs);
+    values.add(task.overruns);
+  }
+  publishJson(teleTasksTopic, jsonDoc);
+}
+
+void serviceTelemetry() {
+  publishTelemetry();
+  publishTaskTelemetry();
+  for (uint8_t i = 1; i < busCount; i++) {
+    publishBusTelemetry(buses[i]);
+  }
+  for (AlarmBus& bus : buses) {
+    if (bus.rules.size() > 0) {
+      publishRuleTelemetry(bus);
+    }
+  }
+}
+
+void warnOverrun(const CrowTask& task, uint32_t tookUs) {
+  char message[64];
+  snprintf(message, sizeof(message), "Tarefa %s demorou %lu us", task.name, (unsigned long)tookUs);
+  Serial.println(message);
+  mqttPublish(logTopic, message);
+}
+
 void setup() {
   // Enable the Watchdog Timer
   ESP.wdtEnable(WDT_TIMEOUT_S * 1000000); // Convert seconds to microseconds
 
   // Get reset cause
   rst_info* resetInfo = ESP.getResetInfoPtr();
-  String resetCause;
   switch (resetInfo->reason) {
     case REASON_DEFAULT_RST:
       resetCause = "Power-on reset";
@@ -488,74 +1612,151 @@ void setup() {
 
   Serial.begin(115200);
 
-  EEPROM.begin(1); // Initialize EEPROM with the number of bytes needed
-  EEPROM.get(statusAddress, statussaved);
-
-  if (statussaved >= 0 && statussaved <= 6) { // Ensure it's a valid value (greater than or equal to 1 and smaller or equal to 5)
-    if (statussaved >= 5){
-      status = statussaved - 4;
-    } else {
-      status = statussaved;
+  if (FS_PHYS_SIZE >= (busCount * (journalSectors + rulesSectors) + recorderSectors) * SPI_FLASH_SEC_SIZE) {
+    uint32_t fsEndSector = (FS_PHYS_ADDR + FS_PHYS_SIZE) / SPI_FLASH_SEC_SIZE;
+    uint32_t recorderSector = fsEndSector - journalSectors - recorderSectors;
+    uint32_t rulesSector = recorderSector - (busCount - 1) * journalSectors - busCount * rulesSectors;
+    buses[0].journalFlash.begin(fsEndSector - journalSectors, journalSectors);
+    recorderFlash.begin(recorderSector, recorderSectors);
+    for (uint8_t i = 0; i < busCount; i++) {
+      if (i > 0) {
+        buses[i].journalFlash.begin(recorderSector - i * journalSectors, journalSectors);
+      }
+      buses[i].rulesFlash.begin(rulesSector + i * rulesSectors, rulesSectors);
     }
-    Serial.println();
-    Serial.println("Status recuperado da EEPROM");
+  }
+  recorder.begin();
+  recorder.recordBoot(resetInfo->reason, millis());
+  Serial.println();
+  EEPROM.begin(eepromSize);
+  loadWifiProfile();
+  for (AlarmBus& bus : buses) {
+    bus.begin();
+    uint8_t topics = EEPROM.read(formatAddress + (&bus - buses));
+    bus.binaryTopics = topics <= binaryAll ? topics : 0; // erased EEPROM reads 0xFF
+    if (bus.statusJournal.begin(statussaved)) {
+      bus.status = statussaved;
+      Serial.printf("%s: status recuperado do journal\n", bus.prefix);
+    } else if (&bus == &buses[0]) {
+      // Journal empty: take over the status saved in EEPROM by older versions
+      EEPROM.get(statusAddress, statussaved);
+      if (statussaved <= 6) {
+        bus.status = crowStableStatus(statussaved);
+        bus.statusJournal.record(bus.status, millis());
+        Serial.println("Status recuperado da EEPROM");
+      }
+    }
+    if (!bus.statusJournal.active()) {
+      Serial.printf("%s: sem flash para o journal, status %s\n", bus.prefix,
+                    statusInEeprom(bus) ? "guardado na EEPROM" : "nao guardado");
+    }
+    static char rulesText[crowRulesTextBytes + 1];
+    size_t rulesLength = crowLoadRules(bus.rulesFlash, rulesText, sizeof(rulesText));
+    uint16_t errorLine;
+    if (rulesLength > 0 && bus.rules.load(rulesText, rulesLength, relayCommands, ruleRelayCount(bus), errorLine)) {
+      Serial.printf("%s: %u regras\n", bus.prefix, bus.rules.size());
+    }
+    bus.rules.onAction = runRuleAction;
+    bus.rules.zoneHoldMs = bus.eventFilter.zoneHoldMs;
   }
 
   pinMode(clockPin, INPUT);
   pinMode(dataPin, INPUT);
+  // pinMode(INPUT) leaves the pin open drain; the ISR only toggles the output
+  // enable, so make it push-pull as pinMode(OUTPUT) did
+  GPC(dataPin) &= ~(1 << GPCD);
+#if SECOND_BUS
+  pinMode(clockPin2, INPUT);
+  pinMode(dataPin2, INPUT);
+  GPC(dataPin2) &= ~(1 << GPCD);
+#else
   pinMode(parcialPin, OUTPUT);
   pinMode(totalPin, OUTPUT);
+#endif
   pinMode(alarmePin, OUTPUT);
-  
-  delay(2000);
-
-  WiFi.persistent(true);
-  WiFi.begin(ssid, password);
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(1000);
-    Serial.println("Connecting to WiFi...");
-  }
-  WiFi.setAutoReconnect(true);
-  Serial.println("Connected to WiFi");
-  Serial.print("IP: ");
-  Serial.println(WiFi.localIP());
-  Serial.print("RSSI: ");
-  Serial.println(WiFi.RSSI());
 
-  client.setServer(mqttServer, mqttPort);
-  while (!client.connected()) {
-    Serial.println("Connecting to MQTT...");
-    if (client.connect(mqttID, mqttUser, mqttPassword, lwtTopic, 0, 1, lwtMessage)) {
-      Serial.println("Connected to MQTT");
-      client.publish(lwtTopic, birthMessage, true);
-      client.subscribe(mqttControlTopic);
-    } else {
-      Serial.print("Failed, rc=");
-      Serial.print(client.state());
-      Serial.println(" Retrying in 5 seconds...");
-      delay(5000);
-    }
+  for (AlarmBus& bus : buses) {
+    bus.port.transmitter.gapTicks = ESP.getCpuFreqMHz() * 1000UL * txGapMs;
+    bus.port.clockFilter.minTicks = ESP.getCpuFreqMHz() * glitchFilterUs;
   }
 
-  client.publish(logTopic, "Started");
-  // Publish reset cause to logTopic
-  const char* resetCauseChar = resetCause.c_str();
-  client.publish(logTopic, resetCauseChar);
+  frameRegistry.add(crowPanelHeader, crowStatusFrameLength, onPanelFrame);
+  frameRegistry.add(crowKeypadHeader, crowKeypressPacketLength, onKeypressFrame);
+  // 72-bit frames whatever their header, as before frame types were told apart
+  frameRegistry.setFallback(crowStatusFrameLength, onPanelFrame);
 
+  // Stage 1: the buses. Frames are decoded from here on, whatever the network does.
   attachInterrupt(digitalPinToInterrupt(clockPin), clockCallback, FALLING);
+#if SECOND_BUS
+  attachInterrupt(digitalPinToInterrupt(clockPin2), clockCallback2, FALLING);
+#endif
+
+  //Get alarm status
+  for (AlarmBus& bus : buses) {
+    queueKeypress(bus, 1);
+    queueKeypress(bus, 17);
+  }
+
+  // Queued in the outbox until MQTT is connected
+  mqttPublish(logTopic, "Started");
+  // Publish reset cause to logTopic
+  mqttPublish(logTopic, resetCause);
+
+  // Stage 2: Wi-Fi, OTA and MQTT connect in the background, see processNetwork().
+  // maintainWifi() reconnects, and keeps the settings in its own profile
+  // rather than in the SDK's flash config.
+  WiFi.persistent(false);
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false);
+  wifiConnectStartMs = millis();
+  beginWifi(wifiProfileValid);
 
+  client.setServer(mqttServer, mqttPort);
+  // Room for the binary capture batches and recorder chunks (topics under 16
+  // characters); publishJson() grows it further for the telemetry
+  size_t binaryBytes = crowCaptureBatchBytes > crowRecorderChunkBytes ? crowCaptureBatchBytes : crowRecorderChunkBytes;
+  client.setBufferSize(mqttHeaderBytes + 16 + binaryBytes);
+  // Keep a connection attempt to an unreachable broker short, loop() retries
+  espClient.setTimeout(2000);
+  client.setSocketTimeout(2);
   client.setCallback(callback);
 
-  // Initialize OTA
+  // Initialize OTA, started by processNetwork() once Wi-Fi is up. The bus is
+  // still decoded and published during the update, see serviceDuringOta().
+  // Images gzipped by scripts/ota_gzip.py are unpacked by the bootloader.
   ArduinoOTA.onStart([]() {
     otaInProgress = true;
+    otaStartMs = millis();
+    otaServicedMs = otaStartMs;
+    otaBlindMs = 0;
+    otaStartOverflows = busOverflows();
     Serial.println("OTA update started...");
   });
+  ArduinoOTA.onProgress([](unsigned int, unsigned int) {
+    serviceDuringOta();
+  });
   ArduinoOTA.onEnd([]() {
     otaInProgress = false;
     Serial.println("\nOTA update finished!");
+    reportOta("concluido");
+    // The restart follows right away: keep what happened during the update
+    for (AlarmBus& bus : buses) {
+      bus.statusJournal.service(millis() + bus.statusJournal.deferMs);
+    }
+    if (eepromStatusPending) {
+      saveStatus(buses[0]);
+    }
+    recorder.snapshot(millis());
+    espClient.flush();
   });
   ArduinoOTA.onError([](ota_error_t error) {
+    otaInProgress = false;
+    char result[24];
+    snprintf(result, sizeof(result), "falhou (erro %u)", error);
+    reportOta(result);
+    if (eepromStatusPending) {
+      saveStatus(buses[0]);
+    }
     Serial.printf("OTA Error[%u]: ", error);
     if (error == OTA_AUTH_ERROR) Serial.println("OTA authentication failed");
     else if (error == OTA_BEGIN_ERROR) Serial.println("OTA begin failed");
@@ -564,81 +1765,11 @@ void setup() {
     else if (error == OTA_END_ERROR) Serial.println("OTA end failed");
   });
 
-  // Start OTA
-  ArduinoOTA.begin();
-  
-  //Get alarm status
-  sendBinaryPacket(1);
-  sendBinaryPacket(17);
+  scheduler.onOverrun = warnOverrun;
+  scheduler.begin();
 }
 
 void loop() {
-  if (!client.connected()) {
-    Serial.println("Reconnecting to MQTT...");
-    if (client.connect(mqttID, mqttUser, mqttPassword, lwtTopic, 0, 1, lwtMessage)) {
-      Serial.println("Reconnected to MQTT");
-      client.publish(lwtTopic, birthMessage, true);
-      client.publish(logTopic, "Reconnected to MQTT");
-      client.subscribe(mqttControlTopic);
-    } else {
-      Serial.print("Failed, rc=");
-      Serial.print(client.state());
-      Serial.println(" Retrying in 5 seconds...");
-      unsigned long retryDelay = 5000;
-      while (millis() - previousMillis < retryDelay) {
-        // Wait for the retryDelay
-        yield();
-      }
-      previousMillis = millis();
-      return;
-    }
-  }
-  client.loop();
-
-  unsigned long currentMillis = millis();
-
-  if (currentMillis - previousMillis >= interval) {
-    // Perform your action here at the specified interval
-    ESP.wdtFeed();
-    previousMillis = currentMillis;
-  }
-
-  if (millis() - previousMillistele >= intervaltele) {
-    // Perform your action here at the specified interval in intervaltele
-    // send tele values
-    // Calculate uptime in milliseconds
-    unsigned long uptimeMillis = millis() - startupTime;
-    // Convert milliseconds to HH:MM:SS format
-    unsigned long seconds = uptimeMillis / 1000;
-    unsigned long minutes = seconds / 60;
-    unsigned long hours = minutes / 60;
-    unsigned long days = hours / 24; // Calculate days
-    seconds %= 60;
-    minutes %= 60;
-    hours %= 24; // Ensure hours don't exceed 24
-
-    // Create a formatted string in DDd HH:MM:SS format
-    char uptimeStr[20]; // Format: DDd HH:MM:SS\0
-    sprintf(uptimeStr, "%luD %02lu:%02lu:%02lu", days, hours, minutes, seconds);
-    // Create a JSON object
-    StaticJsonDocument<128> jsonDoc;
-    // Add the uptime, RSSI and IP values to the JSON object
-    jsonDoc["Uptime"] = String(uptimeStr);
-    jsonDoc["IP"] = WiFi.localIP().toString();
-    jsonDoc["RSSI"] = WiFi.RSSI();
-  
-    // Serialize the JSON object to a string
-    String jsonStr;
-    serializeJson(jsonDoc, jsonStr);
-    // Publish the JSON string to the MQTT teleTopic
-    client.publish(teleTopic, jsonStr.c_str());
-
-    publishStatus(status);
-
-    previousMillistele = millis();
-  }
-
-  // Other non-blocking tasks can go here
-  // Handle OTA updates
-  ArduinoOTA.handle();
+  // All the work is in loopTasks
+  scheduler.runOnce();
 }